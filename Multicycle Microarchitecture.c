@@ -2,11 +2,16 @@
 /*                                                             */
 /* LC-3b Simulator (Adapted from Prof. Yale Patt at UT Austin) */
 /*                                                             */
+/* The interactive shell. The simulator itself is in lc3bsim.c */
+/* and is driven through the API in lc3bsim.h.                 */
+/*                                                             */
 /***************************************************************/
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include "lc3bsim.h"
 
 /***************************************************************/
 /*                                                             */
@@ -15,320 +20,487 @@
 /*                                                             */
 /***************************************************************/
 
-/***************************************************************/
-/* These are the functions you'll have to write.               */
-/***************************************************************/
-
-void eval_micro_sequencer();
-void cycle_memory();
-void eval_bus_drivers();
-void drive_bus();
-void latch_datapath_values();
-
 /***************************************************************/
 /* A couple of useful definitions.                             */
 /***************************************************************/
 #define FALSE 0
 #define TRUE  1
 
+#define LC_3b_REGS 8
+
 /***************************************************************/
-/* Use this to avoid overflowing 16 bits on the bus.           */
+/* The machine the commands operate on.                        */
 /***************************************************************/
-#define Low16bits(x) ((x) & 0xFFFF)
+lc3b_machine *MACHINE;
 
 /***************************************************************/
-/* Definition of the control store layout.                     */
+/* The trace being recorded, NULL if none.                     */
 /***************************************************************/
-#define CONTROL_STORE_ROWS 64
-#define INITIAL_STATE_NUMBER 18
+FILE *TRACE;
+
+void mdump_strip(char *text, int n, FILE * dumpsim_file);
+void reload_ucode(char *ucode_filename);
 
 /***************************************************************/
-/* Definition of bit order in control store word.              */
+/*                                                             */
+/* Procedure : help                                            */
+/*                                                             */
+/* Purpose   : Print out a list of commands.                   */
+/*                                                             */
 /***************************************************************/
-enum CS_BITS {                                                  
-    IRD,
-    COND1, COND0,
-    J5, J4, J3, J2, J1, J0,
-    LD_MAR,
-    LD_MDR,
-    LD_IR,
-    LD_BEN,
-    LD_REG,
-    LD_CC,
-    LD_PC,
-    GATE_PC,
-    GATE_MDR,
-    GATE_ALU,
-    GATE_MARMUX,
-    GATE_SHF,
-    PCMUX1, PCMUX0,
-    DRMUX,
-    SR1MUX,
-    ADDR1MUX,
-    ADDR2MUX1, ADDR2MUX0,
-    MARMUX,
-    ALUK1, ALUK0,
-    MIO_EN,
-    R_W,
-    DATA_SIZE,
-    LSHF1,
-    CONTROL_STORE_BITS
-} CS_BITS;
+void help() {
+    printf("----------------LC-3bSIM Help-------------------------\n");
+    printf("go               -  run program to completion       \n");
+    printf("run n            -  execute program for n cycles    \n");
+    printf("mdump low high   -  dump memory from low to high    \n");
+    printf("rdump            -  dump the register & bus values  \n");
+    printf("bdump file lo hi -  append binary dump of memory     \n");
+    printf("                    lo..hi and latches to file      \n");
+    printf("idump file       -  append words written since the  \n");
+    printf("                    last idump and latches to file  \n");
+    printf("cosim on|off     -  check against ISA reference model\n");
+    printf("system n q       -  run n cores on shared memory,   \n");
+    printf("                    synchronized every q cycles;    \n");
+    printf("                    memory changes, latches don't   \n");
+    printf("snap k kb        -  snapshot every k cycles, keep   \n");
+    printf("                    kb kilobytes of history         \n");
+    printf("rstep n          -  go back n cycles                \n");
+    printf("rgo c            -  go back (or forward) to cycle c \n");
+    printf("trace file|off   -  record microstates and memory   \n");
+    printf("                    accesses to file                \n");
+    printf("reload-ucode file - replace the control store,      \n");
+    printf("                    keeping memory and latches      \n");
+    printf("replay file m l b h - re-time trace, m cycles per   \n");
+    printf("                    access, l lines of b bytes with \n");
+    printf("                    h cycle hits (l = 0: no cache)  \n");
+    printf("energy on|off    -  count switching activity        \n");
+    printf("energy file      -  report energy with the weights  \n");
+    printf("                    in file                         \n");
+    printf("fuse on|off      -  run straight-line microstate    \n");
+    printf("                    chains as single host steps     \n");
+    printf("fuse report      -  print the fused chains and the  \n");
+    printf("                    microcode path of each opcode   \n");
+    printf("live file k      -  publish statistics to file every\n");
+    printf("                    k cycles, for lc3btop           \n");
+    printf("live off         -  stop publishing statistics      \n");
+    printf("?                -  display this help menu          \n");
+    printf("quit             -  exit the program                \n\n");
+}
+
+/* Print the co-simulation report if the last step diverged. */
+int report_divergence() {
+    if (lc3b_status(MACHINE) != LC3B_DIVERGED)
+	return FALSE;
+    printf("%s", lc3b_cosim_report(MACHINE));
+    printf("Simulator stopped at cycle %d\n\n", lc3b_cycles(MACHINE));
+    return TRUE;
+}
 
 /***************************************************************/
-/* Functions to get at the control bits.                       */
+/*                                                             */
+/* Procedure : run n                                           */
+/*                                                             */
+/* Purpose   : Simulate the LC-3b for n cycles.                 */
+/*                                                             */
 /***************************************************************/
-int GetIRD(int *x)           { return(x[IRD]); }
-int GetCOND(int *x)          { return((x[COND1] << 1) + x[COND0]); }
-int GetJ(int *x)             { return((x[J5] << 5) + (x[J4] << 4) +
-				      (x[J3] << 3) + (x[J2] << 2) +
-				      (x[J1] << 1) + x[J0]); }
-int GetLD_MAR(int *x)        { return(x[LD_MAR]); }
-int GetLD_MDR(int *x)        { return(x[LD_MDR]); }
-int GetLD_IR(int *x)         { return(x[LD_IR]); }
-int GetLD_BEN(int *x)        { return(x[LD_BEN]); }
-int GetLD_REG(int *x)        { return(x[LD_REG]); }
-int GetLD_CC(int *x)         { return(x[LD_CC]); }
-int GetLD_PC(int *x)         { return(x[LD_PC]); }
-int GetGATE_PC(int *x)       { return(x[GATE_PC]); }
-int GetGATE_MDR(int *x)      { return(x[GATE_MDR]); }
-int GetGATE_ALU(int *x)      { return(x[GATE_ALU]); }
-int GetGATE_MARMUX(int *x)   { return(x[GATE_MARMUX]); }
-int GetGATE_SHF(int *x)      { return(x[GATE_SHF]); }
-int GetPCMUX(int *x)         { return((x[PCMUX1] << 1) + x[PCMUX0]); }
-int GetDRMUX(int *x)         { return(x[DRMUX]); }
-int GetSR1MUX(int *x)        { return(x[SR1MUX]); }
-int GetADDR1MUX(int *x)      { return(x[ADDR1MUX]); }
-int GetADDR2MUX(int *x)      { return((x[ADDR2MUX1] << 1) + x[ADDR2MUX0]); }
-int GetMARMUX(int *x)        { return(x[MARMUX]); }
-int GetALUK(int *x)          { return((x[ALUK1] << 1) + x[ALUK0]); }
-int GetMIO_EN(int *x)        { return(x[MIO_EN]); }
-int GetR_W(int *x)           { return(x[R_W]); }
-int GetDATA_SIZE(int *x)     { return(x[DATA_SIZE]); } 
-int GetLSHF1(int *x)         { return(x[LSHF1]); }
+void run(int num_cycles) {
+    if (lc3b_status(MACHINE) != LC3B_RUNNING) {
+	printf("Can't simulate, Simulator is halted\n\n");
+	return;
+    }
+
+    printf("Simulating for %d cycles...\n\n", num_cycles);
+    lc3b_step_cycles(MACHINE, num_cycles);
+    if (!report_divergence() && lc3b_status(MACHINE) == LC3B_HALTED)
+	printf("Simulator halted\n\n");
+}
 
 /***************************************************************/
-/* The control store rom.                                      */
+/*                                                             */
+/* Procedure : go                                              */
+/*                                                             */
+/* Purpose   : Simulate the LC-3b until HALTed.                 */
+/*                                                             */
 /***************************************************************/
-int CONTROL_STORE[CONTROL_STORE_ROWS][CONTROL_STORE_BITS];
+void go() {
+    if (lc3b_status(MACHINE) != LC3B_RUNNING) {
+	printf("Can't simulate, Simulator is halted\n\n");
+	return;
+    }
+
+    printf("Simulating...\n\n");
+    while (lc3b_status(MACHINE) == LC3B_RUNNING)
+	lc3b_step_cycles(MACHINE, INT_MAX);
+    if (report_divergence()) return;
+    printf("Simulator halted\n\n");
+}
 
 /***************************************************************/
-/* Main memory.                                                */
+/*                                                             */
+/* Procedure : mdump                                           */
+/*                                                             */
+/* Purpose   : Dump a word-aligned region of memory to the     */
+/*             output file.                                    */
+/*                                                             */
 /***************************************************************/
-/* MEMORY[A][0] stores the least significant byte of word at word address A
-   MEMORY[A][1] stores the most significant byte of word at word address A 
-   There are two write enable signals, one for each byte. WE0 is used for 
-   the least significant byte of a word. WE1 is used for the most significant 
-   byte of a word. */
+void mdump(FILE * dumpsim_file, int start, int stop) {
+    int address; /* this is a byte address */
+    char text[8192];
+    int n;
+
+    /* Format every line once; the console copy is indented one more space. */
+    n = sprintf(text, "\nMemory content [0x%04x..0x%04x] :\n", start, stop);
+    n += sprintf(text + n, "-------------------------------------\n");
+    fwrite(text, 1, n, stdout);
+    fwrite(text, 1, n, dumpsim_file);
+
+    n = 0;
+    for (address = (start >> 1); address <= (stop >> 1); address++) {
+	n += sprintf(text + n, "  0x%04x (%d) : 0x%04x\n", address << 1, address << 1, lc3b_read_word(MACHINE, address << 1));
+	if (n > (int) sizeof(text) - 64 || address == (stop >> 1)) {
+	    fwrite(text, 1, n, stdout);
+	    mdump_strip(text, n, dumpsim_file);
+	    n = 0;
+	}
+    }
+    printf("\n");
+    fprintf(dumpsim_file, "\n");
+}
 
-#define WORDS_IN_MEM    0x08000 
-#define MEM_CYCLES      5
-int MEMORY[WORDS_IN_MEM][2];
+/* Write lines formatted for the console to the dumpsim file, dropping
+   the extra space of indentation at the start of each line. */
+void mdump_strip(char *text, int n, FILE * dumpsim_file) {
+    char *line = text, *end = text + n, *next;
 
-/***************************************************************/
+    while (line < end) {
+	next = (char *) memchr(line, '\n', end - line) + 1;
+	fwrite(line + 1, 1, next - line - 1, dumpsim_file);
+	line = next;
+    }
+}
 
 /***************************************************************/
+/*                                                             */
+/* Procedure : rdump                                           */
+/*                                                             */
+/* Purpose   : Dump current register and bus values to the     */
+/*             output file.                                    */
+/*                                                             */
+/***************************************************************/
+void rdump(FILE * dumpsim_file) {
+    int k, n;
+    char text[1024];
+
+    n = sprintf(text, "\nCurrent register/bus values :\n");
+    n += sprintf(text + n, "-------------------------------------\n");
+    n += sprintf(text + n, "Cycle Count  : %d\n", lc3b_cycles(MACHINE));
+    n += sprintf(text + n, "PC           : 0x%04x\n", lc3b_get_reg(MACHINE, LC3B_PC));
+    n += sprintf(text + n, "IR           : 0x%04x\n", lc3b_get_reg(MACHINE, LC3B_IR));
+    n += sprintf(text + n, "STATE_NUMBER : 0x%04x\n\n", lc3b_get_reg(MACHINE, LC3B_STATE_NUMBER));
+    n += sprintf(text + n, "BUS          : 0x%04x\n", lc3b_get_reg(MACHINE, LC3B_BUS));
+    n += sprintf(text + n, "MDR          : 0x%04x\n", lc3b_get_reg(MACHINE, LC3B_MDR));
+    n += sprintf(text + n, "MAR          : 0x%04x\n", lc3b_get_reg(MACHINE, LC3B_MAR));
+    n += sprintf(text + n, "CCs: N = %d  Z = %d  P = %d\n", lc3b_get_reg(MACHINE, LC3B_N),
+		 lc3b_get_reg(MACHINE, LC3B_Z), lc3b_get_reg(MACHINE, LC3B_P));
+    n += sprintf(text + n, "Registers:\n");
+    for (k = 0; k < LC_3b_REGS; k++)
+	n += sprintf(text + n, "%d: 0x%04x\n", k, lc3b_get_reg(MACHINE, LC3B_R0 + k));
+    n += sprintf(text + n, "\n");
+
+    /* the same text goes to the console and the dumpsim file */
+    fwrite(text, 1, n, stdout);
+    fwrite(text, 1, n, dumpsim_file);
+}
 
 /***************************************************************/
-/* LC-3b State info.                                           */
+/*                                                             */
+/* Procedure : bdump                                           */
+/*                                                             */
+/* Purpose   : Append the latches and a word-aligned region    */
+/*             of memory to a binary dump file.                */
+/*                                                             */
 /***************************************************************/
-#define LC_3b_REGS 8
-
-int RUN_BIT;	/* run bit */
-int BUS;	/* value of the bus */
+void bdump(char *dump_filename, int start, int stop) {
+    FILE * dump_file;
+    int count;
 
-typedef struct System_Latches_Struct{
+    if ((dump_file = fopen(dump_filename, "ab")) == NULL) {
+	printf("Error: Can't open dump file %s\n\n", dump_filename);
+	return;
+    }
+    count = lc3b_dump_full(MACHINE, dump_file, start, stop);
+    fclose(dump_file);
 
-int PC,		/* program counter */
-    MDR,	/* memory data register */
-    MAR,	/* memory address register */
-    IR,		/* instruction register */
-    N,		/* n condition bit */
-    Z,		/* z condition bit */
-    P,		/* p condition bit */
-    BEN;        /* ben register */
+    if (count == LC3B_ERROR)
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
+    else
+	printf("Dumped %d words to %s\n\n", count, dump_filename);
+}
 
-int READY;	/* ready bit */
-  /* The ready bit is also latched as you dont want the memory system to assert it 
-     at a bad point in the cycle*/
+/***************************************************************/
+/*                                                             */
+/* Procedure : idump                                           */
+/*                                                             */
+/* Purpose   : Append the latches and every memory word        */
+/*             written since the previous idump to a binary    */
+/*             dump file.                                      */
+/*                                                             */
+/***************************************************************/
+void idump(char *dump_filename) {
+    FILE * dump_file;
+    int count;
 
-int REGS[LC_3b_REGS]; /* register file. */
+    if ((dump_file = fopen(dump_filename, "ab")) == NULL) {
+	printf("Error: Can't open dump file %s\n\n", dump_filename);
+	return;
+    }
+    count = lc3b_dump_incremental(MACHINE, dump_file);
+    fclose(dump_file);
 
-int MICROINSTRUCTION[CONTROL_STORE_BITS]; /* The microintruction */
+    printf("Dumped %d changed words to %s\n\n", count, dump_filename);
+}
 
-int STATE_NUMBER; /* Current State Number - Provided for debugging */ 
-} System_Latches;
+/***************************************************************/
+/*                                                             */
+/* Procedure : cosim                                           */
+/*                                                             */
+/* Purpose   : Turn co-simulation on or off.                   */
+/*                                                             */
+/***************************************************************/
+void cosim(int on) {
+    int checked;
 
-/* Data Structure for Latch */
+    if (on) {
+	if (lc3b_cosim_start(MACHINE) == LC3B_ERROR)
+	    printf("Error: %s\n\n", lc3b_message(MACHINE));
+	else
+	    printf("Co-simulation on\n\n");
+	return;
+    }
 
-System_Latches CURRENT_LATCHES, NEXT_LATCHES;
+    checked = lc3b_cosim_stop(MACHINE);
+    if (!report_divergence())
+	printf("Co-simulation off, %d instructions checked\n\n", checked);
+}
 
 /***************************************************************/
-/* A cycle counter.                                            */
+/*                                                             */
+/* Procedure : run_system                                      */
+/*                                                             */
+/* Purpose   : Run num_cores cores on shared memory and print  */
+/*             what each of them did. The machine keeps the    */
+/*             memory they leave behind, but its own latches   */
+/*             are as they were before the run.                */
+/*                                                             */
 /***************************************************************/
-int CYCLE_COUNT;
+void run_system(int num_cores, int quantum) {
+    lc3b_core_stats *stats = NULL;
+    int i;
+
+    if (lc3b_status(MACHINE) != LC3B_RUNNING) {
+	printf("Can't simulate, Simulator is halted\n\n");
+	return;
+    }
+    if (num_cores > 0 && (stats = calloc(num_cores, sizeof(lc3b_core_stats))) == NULL) {
+	printf("Error: Can't allocate cores\n\n");
+	return;
+    }
+
+    printf("Simulating %d cores, quantum %d cycles...\n\n", num_cores, quantum);
+    fflush(stdout);
+    if (lc3b_run_system(MACHINE, num_cores, quantum, stats) == LC3B_ERROR) {
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
+	free(stats);
+	return;
+    }
+
+    printf("Core  Cycles      Instructions  Bus stalls\n");
+    for (i = 0; i < num_cores; i++)
+	printf("%-4d  %-10d  %-12d  %d\n", i, stats[i].cycles, stats[i].instructions, stats[i].bus_stalls);
+    printf("\n");
+
+    free(stats);
+}
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : help                                            */
+/* Procedure : snap                                            */
 /*                                                             */
-/* Purpose   : Print out a list of commands.                   */
+/* Purpose   : Configure reverse execution.                    */
 /*                                                             */
 /***************************************************************/
-void help() {                                                    
-    printf("----------------LC-3bSIM Help-------------------------\n");
-    printf("go               -  run program to completion       \n");
-    printf("run n            -  execute program for n cycles    \n");
-    printf("mdump low high   -  dump memory from low to high    \n");
-    printf("rdump            -  dump the register & bus values  \n");
-    printf("?                -  display this help menu          \n");
-    printf("quit             -  exit the program                \n\n");
+void snap(int interval, int budget_kb) {
+    if (lc3b_history(MACHINE, interval, budget_kb) == LC3B_ERROR)
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
+    else if (interval <= 0)
+	printf("Reverse execution off\n\n");
+    else
+	printf("Snapshot every %d cycles, keeping up to %d KB of history\n\n",
+	       interval, budget_kb);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : cycle                                           */
+/* Procedure : rgo                                             */
 /*                                                             */
-/* Purpose   : Execute a cycle                                 */
+/* Purpose   : Go back (or forward) to a cycle.                */
 /*                                                             */
 /***************************************************************/
-void cycle() {                                                
-
-  eval_micro_sequencer();   
-  cycle_memory();
-  eval_bus_drivers();
-  drive_bus();
-  latch_datapath_values();
-
-  CURRENT_LATCHES = NEXT_LATCHES;
-
-  CYCLE_COUNT++;
+void rgo(int target_cycle) {
+    if (lc3b_goto_cycle(MACHINE, target_cycle) == LC3B_ERROR)
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
+    else
+	printf("At cycle %d\n\n", lc3b_cycles(MACHINE));
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : run n                                           */
+/* Procedure : trace                                           */
 /*                                                             */
-/* Purpose   : Simulate the LC-3b for n cycles.                 */
+/* Purpose   : Start recording a trace to a file, or stop.     */
 /*                                                             */
 /***************************************************************/
-void run(int num_cycles) {                                      
-    int i;
+void trace(char *trace_filename) {
+    if (TRACE != NULL) {
+	lc3b_trace_stop(MACHINE);
+	fclose(TRACE);
+	TRACE = NULL;
+	printf("Trace closed\n\n");
+    }
+    if (strcmp(trace_filename, "off") == 0)
+	return;
 
-    if (RUN_BIT == FALSE) {
-	printf("Can't simulate, Simulator is halted\n\n");
+    if ((TRACE = fopen(trace_filename, "wb")) == NULL) {
+	printf("Error: Can't open trace file %s\n\n", trace_filename);
 	return;
     }
-
-    printf("Simulating for %d cycles...\n\n", num_cycles);
-    for (i = 0; i < num_cycles; i++) {
-	if (CURRENT_LATCHES.PC == 0x0000) {
-	    RUN_BIT = FALSE;
-	    printf("Simulator halted\n\n");
-	    break;
-	}
-	cycle();
+    if (lc3b_trace_start(MACHINE, TRACE) == LC3B_ERROR) {
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
+	fclose(TRACE);
+	TRACE = NULL;
+	return;
     }
+    printf("Tracing to %s\n\n", trace_filename);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : go                                              */
+/* Procedure : live                                            */
 /*                                                             */
-/* Purpose   : Simulate the LC-3b until HALTed.                 */
+/* Purpose   : Publish live statistics for lc3btop.            */
 /*                                                             */
 /***************************************************************/
-void go() {                                                     
-    if (RUN_BIT == FALSE) {
-	printf("Can't simulate, Simulator is halted\n\n");
+void live(char *stats_filename, int interval) {
+    if (lc3b_live_start(MACHINE, stats_filename, interval) == LC3B_ERROR) {
+	printf("Error: %s\n\n", lc3b_message(MACHINE));
 	return;
     }
-
-    printf("Simulating...\n\n");
-    while (CURRENT_LATCHES.PC != 0x0000)
-	cycle();
-    RUN_BIT = FALSE;
-    printf("Simulator halted\n\n");
+    printf("Publishing statistics to %s every %d cycles\n\n", stats_filename, interval);
 }
 
-/***************************************************************/ 
+/***************************************************************/
 /*                                                             */
-/* Procedure : mdump                                           */
+/* Procedure : replay                                          */
 /*                                                             */
-/* Purpose   : Dump a word-aligned region of memory to the     */
-/*             output file.                                    */
+/* Purpose   : Re-time a trace against another memory system.  */
 /*                                                             */
 /***************************************************************/
-void mdump(FILE * dumpsim_file, int start, int stop) {          
-    int address; /* this is a byte address */
+void replay(char *trace_filename, lc3b_timing *timing) {
+    FILE * trace_file;
+    lc3b_replay_stats stats;
 
-    printf("\nMemory content [0x%04x..0x%04x] :\n", start, stop);
-    printf("-------------------------------------\n");
-    for (address = (start >> 1); address <= (stop >> 1); address++)
-	printf("  0x%04x (%d) : 0x%02x%02x\n", address << 1, address << 1, MEMORY[address][1], MEMORY[address][0]);
+    if (TRACE != NULL)
+	fflush(TRACE);
+    if ((trace_file = fopen(trace_filename, "rb")) == NULL) {
+	printf("Error: Can't open trace file %s\n\n", trace_filename);
+	return;
+    }
+    if (lc3b_trace_replay(trace_file, timing, &stats) == LC3B_ERROR) {
+	printf("Error: %s is not a trace, or the timing is invalid\n\n", trace_filename);
+	fclose(trace_file);
+	return;
+    }
+    fclose(trace_file);
+
+    printf("Cycles       : %d\n", stats.cycles);
+    printf("Instructions : %d\n", stats.instructions);
+    if (stats.instructions > 0)
+	printf("CPI          : %.2f\n", (double) stats.cycles / stats.instructions);
+    printf("Reads        : %d\n", stats.reads);
+    printf("Writes       : %d\n", stats.writes);
+    if (timing->cache_lines > 0) {
+	printf("Read hits    : %d  misses : %d\n", stats.hits, stats.misses);
+	printf("Write hits   : %d  misses : %d\n", stats.write_hits, stats.write_misses);
+    }
     printf("\n");
-
-    /* dump the memory contents into the dumpsim file */
-    fprintf(dumpsim_file, "\nMemory content [0x%04x..0x%04x] :\n", start, stop);
-    fprintf(dumpsim_file, "-------------------------------------\n");
-    for (address = (start >> 1); address <= (stop >> 1); address++)
-	fprintf(dumpsim_file, " 0x%04x (%d) : 0x%02x%02x\n", address << 1, address << 1, MEMORY[address][1], MEMORY[address][0]);
-    fprintf(dumpsim_file, "\n");
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : rdump                                           */
+/* Procedure : energy                                          */
 /*                                                             */
-/* Purpose   : Dump current register and bus values to the     */   
-/*             output file.                                    */
+/* Purpose   : Weigh the switching activity counted so far     */
+/*             with the per-component weights in a file and    */
+/*             print the energy of each component.             */
+/*                                                             */
+/*             Each line of the file is a counter name and the */
+/*             energy of one event or bit toggle; # starts a   */
+/*             comment. Counters not listed weigh nothing.     */
 /*                                                             */
 /***************************************************************/
-void rdump(FILE * dumpsim_file) {                               
-    int k; 
-
-    printf("\nCurrent register/bus values :\n");
-    printf("-------------------------------------\n");
-    printf("Cycle Count  : %d\n", CYCLE_COUNT);
-    printf("PC           : 0x%04x\n", CURRENT_LATCHES.PC);
-    printf("IR           : 0x%04x\n", CURRENT_LATCHES.IR);
-    printf("STATE_NUMBER : 0x%04x\n\n", CURRENT_LATCHES.STATE_NUMBER);
-    printf("BUS          : 0x%04x\n", BUS);
-    printf("MDR          : 0x%04x\n", CURRENT_LATCHES.MDR);
-    printf("MAR          : 0x%04x\n", CURRENT_LATCHES.MAR);
-    printf("CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
-    printf("Registers:\n");
-    for (k = 0; k < LC_3b_REGS; k++)
-	printf("%d: 0x%04x\n", k, CURRENT_LATCHES.REGS[k]);
-    printf("\n");
+void energy(char *weights_filename) {
+    FILE * weights_file;
+    char line[200], name[100];
+    double weights[LC3B_ACTIVITY_COUNTERS] = {0}, weight, total = 0;
+    unsigned long long counts[LC3B_ACTIVITY_COUNTERS];
+    int k, line_number = 0;
 
-    /* dump the state information into the dumpsim file */
-    fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
-    fprintf(dumpsim_file, "-------------------------------------\n");
-    fprintf(dumpsim_file, "Cycle Count  : %d\n", CYCLE_COUNT);
-    fprintf(dumpsim_file, "PC           : 0x%04x\n", CURRENT_LATCHES.PC);
-    fprintf(dumpsim_file, "IR           : 0x%04x\n", CURRENT_LATCHES.IR);
-    fprintf(dumpsim_file, "STATE_NUMBER : 0x%04x\n\n", CURRENT_LATCHES.STATE_NUMBER);
-    fprintf(dumpsim_file, "BUS          : 0x%04x\n", BUS);
-    fprintf(dumpsim_file, "MDR          : 0x%04x\n", CURRENT_LATCHES.MDR);
-    fprintf(dumpsim_file, "MAR          : 0x%04x\n", CURRENT_LATCHES.MAR);
-    fprintf(dumpsim_file, "CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
-    fprintf(dumpsim_file, "Registers:\n");
-    for (k = 0; k < LC_3b_REGS; k++)
-	fprintf(dumpsim_file, "%d: 0x%04x\n", k, CURRENT_LATCHES.REGS[k]);
-    fprintf(dumpsim_file, "\n");
+    if ((weights_file = fopen(weights_filename, "r")) == NULL) {
+	printf("Error: Can't open weights file %s\n\n", weights_filename);
+	return;
+    }
+    while (fgets(line, sizeof(line), weights_file) != NULL) {
+	line_number++;
+	line[strcspn(line, "#")] = '\0';
+	if (sscanf(line, "%99s", name) != 1)
+	    continue;
+	for (k = 0; k < LC3B_ACTIVITY_COUNTERS; k++)
+	    if (strcmp(name, lc3b_activity_name(k)) == 0)
+		break;
+	if (k == LC3B_ACTIVITY_COUNTERS || sscanf(line, "%*s %lf", &weight) != 1) {
+	    printf("Error: %s, line %d: expected a counter name and a weight\n\n",
+		   weights_filename, line_number);
+	    fclose(weights_file);
+	    return;
+	}
+	weights[k] = weight;
+    }
+    fclose(weights_file);
+
+    lc3b_activity_counts(MACHINE, counts);
+    printf("Component       Count           Weight      Energy\n");
+    for (k = 0; k < LC3B_ACTIVITY_COUNTERS; k++) {
+	printf("%-14s  %-14llu  %-10g  %.1f\n", lc3b_activity_name(k), counts[k],
+	       weights[k], counts[k] * weights[k]);
+	total += counts[k] * weights[k];
+    }
+    printf("Total energy : %.1f", total);
+    if (counts[LC3B_ACT_CYCLES] > 0)
+	printf(", %.2f per cycle", total / counts[LC3B_ACT_CYCLES]);
+    printf("\n\n");
 }
 
 /***************************************************************/
 /*                                                             */
 /* Procedure : get_command                                     */
 /*                                                             */
-/* Purpose   : Read a command from standard input.             */  
+/* Purpose   : Read a command from standard input.             */
 /*                                                             */
 /***************************************************************/
-void get_command(FILE * dumpsim_file) {                         
-    char buffer[20];
+void get_command(FILE * dumpsim_file) {
+    char buffer[20], filename[200];
     int start, stop, cycles;
+    lc3b_timing timing;
 
     printf("LC-3b-SIM> ");
 
@@ -350,15 +522,111 @@ void get_command(FILE * dumpsim_file) {
     case '?':
 	help();
 	break;
+
+    case 'C':
+    case 'c':
+	scanf("%19s", buffer);
+	if (strcmp(buffer, "on") == 0)
+	    cosim(TRUE);
+	else if (strcmp(buffer, "off") == 0)
+	    cosim(FALSE);
+	else
+	    printf("Invalid Command\n");
+	break;
+
+    case 'S':
+    case 's':
+	scanf("%i %i", &start, &stop);
+	if (buffer[1] == 'n' || buffer[1] == 'N')
+	    snap(start, stop);
+	else
+	    run_system(start, stop);
+	break;
+
+    case 'F':
+    case 'f':
+	scanf("%19s", buffer);
+	if (strcmp(buffer, "on") == 0 || strcmp(buffer, "off") == 0) {
+	    lc3b_fusion(MACHINE, buffer[1] == 'n');
+	    printf("Fusion %s\n\n", buffer);
+	}
+	else if (strcmp(buffer, "report") == 0) {
+	    lc3b_fusion_report(MACHINE, stdout);
+	    printf("\n");
+	}
+	else
+	    printf("Invalid Command\n");
+	break;
+
+    case 'L':
+    case 'l':
+	scanf("%199s", filename);
+	if (strcmp(filename, "off") == 0) {
+	    lc3b_live_stop(MACHINE);
+	    printf("Statistics no longer published\n\n");
+	}
+	else {
+	    scanf("%i", &cycles);
+	    live(filename, cycles);
+	}
+	break;
+
     case 'Q':
     case 'q':
+	lc3b_live_stop(MACHINE);
 	printf("Bye.\n");
 	exit(0);
 
+    case 'B':
+    case 'b':
+	scanf("%199s %i %i", filename, &start, &stop);
+	bdump(filename, start, stop);
+	break;
+
+    case 'I':
+    case 'i':
+	scanf("%199s", filename);
+	idump(filename);
+	break;
+
+    case 'E':
+    case 'e':
+	scanf("%199s", filename);
+	if (strcmp(filename, "on") == 0 || strcmp(filename, "off") == 0) {
+	    lc3b_activity(MACHINE, filename[1] == 'n');
+	    printf("Activity counting %s\n\n", filename);
+	}
+	else
+	    energy(filename);
+	break;
+
+    case 'T':
+    case 't':
+	scanf("%199s", filename);
+	trace(filename);
+	break;
+
     case 'R':
     case 'r':
 	if (buffer[1] == 'd' || buffer[1] == 'D')
 	    rdump(dumpsim_file);
+	else if (buffer[1] == 's' || buffer[1] == 'S') {
+	    scanf("%d", &cycles);
+	    rgo(lc3b_cycles(MACHINE) - cycles);
+	}
+	else if (buffer[1] == 'g' || buffer[1] == 'G') {
+	    scanf("%d", &cycles);
+	    rgo(cycles);
+	}
+	else if ((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 'l' || buffer[2] == 'L')) {
+	    scanf("%199s", filename);
+	    reload_ucode(filename);
+	}
+	else if (buffer[1] == 'e' || buffer[1] == 'E') {
+	    scanf("%199s %i %i %i %i", filename, &timing.mem_cycles, &timing.cache_lines,
+		  &timing.line_bytes, &timing.hit_cycles);
+	    replay(filename, &timing);
+	}
 	else {
 	    scanf("%d", &cycles);
 	    run(cycles);
@@ -373,147 +641,111 @@ void get_command(FILE * dumpsim_file) {
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : init_control_store                              */
+/* Procedure : read_file                                       */
 /*                                                             */
-/* Purpose   : Load microprogram into control store ROM        */ 
+/* Purpose   : Read a whole file into memory. Returns NULL if  */
+/*             it can't be read.                               */
 /*                                                             */
 /***************************************************************/
-void init_control_store(char *ucode_filename) {                 
-    FILE *ucode;
-    int i, j, index;
-    char line[200];
+char *read_file(char *filename, char *what, size_t *length) {
+    FILE *file;
+    char *text = NULL;
+    size_t size = 0;
 
-    printf("Loading Control Store from file: %s\n", ucode_filename);
-
-    /* Open the micro-code file. */
-    if ((ucode = fopen(ucode_filename, "r")) == NULL) {
-	printf("Error: Can't open micro-code file %s\n", ucode_filename);
-	exit(-1);
+    if ((file = fopen(filename, "r")) == NULL) {
+	printf("Error: Can't open %s %s\n", what, filename);
+	return NULL;
     }
-
-    /* Read a line for each row in the control store. */
-    for(i = 0; i < CONTROL_STORE_ROWS; i++) {
-	if (fscanf(ucode, "%[^\n]\n", line) == EOF) {
-	    printf("Error: Too few lines (%d) in micro-code file: %s\n",
-		   i, ucode_filename);
-	    exit(-1);
-	}
-
-	/* Put in bits one at a time. */
-	index = 0;
-
-	for (j = 0; j < CONTROL_STORE_BITS; j++) {
-	    /* Needs to find enough bits in line. */
-	    if (line[index] == '\0') {
-		printf("Error: Too few control bits in micro-code file: %s\nLine: %d\n",
-		       ucode_filename, i);
-		exit(-1);
-	    }
-	    if (line[index] != '0' && line[index] != '1') {
-		printf("Error: Unknown value in micro-code file: %s\nLine: %d, Bit: %d\n",
-		       ucode_filename, i, j);
-		exit(-1);
-	    }
-
-	    /* Set the bit in the Control Store. */
-	    CONTROL_STORE[i][j] = (line[index] == '0') ? 0:1;
-	    index++;
+    do {
+	if ((text = realloc(text, size + 4096)) == NULL) {
+	    printf("Error: Can't read %s %s\n", what, filename);
+	    fclose(file);
+	    return NULL;
 	}
+	size += fread(text + size, 1, 4096, file);
+    } while (!feof(file) && !ferror(file));
+    fclose(file);
 
-	/* Warn about extra bits in line. */
-	if (line[index] != '\0')
-	    printf("Warning: Extra bit(s) in control store file %s. Line: %d\n",
-		   ucode_filename, i);
-    }
-    printf("\n");
+    *length = size;
+    return text;
 }
 
-/************************************************************/
-/*                                                          */
-/* Procedure : init_memory                                  */
-/*                                                          */
-/* Purpose   : Zero out the memory array                    */
-/*                                                          */
-/************************************************************/
-void init_memory() {                                           
-    int i;
-
-    for (i=0; i < WORDS_IN_MEM; i++) {
-	MEMORY[i][0] = 0;
-	MEMORY[i][1] = 0;
-    }
-}
+/***************************************************************/
+/*                                                             */
+/* Procedure : reload_ucode                                    */
+/*                                                             */
+/* Purpose   : Replace the control store of the running        */
+/*             machine, keeping memory and latches.            */
+/*                                                             */
+/***************************************************************/
+void reload_ucode(char *ucode_filename) {
+    char *text;
+    size_t length;
 
-/**************************************************************/
-/*                                                            */
-/* Procedure : load_program                                   */
-/*                                                            */
-/* Purpose   : Load program and service routines into mem.    */
-/*                                                            */
-/**************************************************************/
-void load_program(char *program_filename) {                   
-    FILE * prog;
-    int ii, word, program_base;
-
-    /* Open program file. */
-    prog = fopen(program_filename, "r");
-    if (prog == NULL) {
-	printf("Error: Can't open program file %s\n", program_filename);
-	exit(-1);
+    if ((text = read_file(ucode_filename, "micro-code file", &length)) == NULL) {
+	printf("\n");
+	return;
     }
-
-    /* Read in the program. */
-    if (fscanf(prog, "%x\n", &word) != EOF)
-	program_base = word >> 1;
+    if (lc3b_load_ucode(MACHINE, text, length) == LC3B_ERROR)
+	printf("Error: %s: %s, control store unchanged\n\n", ucode_filename, lc3b_message(MACHINE));
     else {
-	printf("Error: Program file is empty\n");
-	exit(-1);
+	if (lc3b_message(MACHINE)[0] != '\0')
+	    printf("Warning: %s: %s\n", ucode_filename, lc3b_message(MACHINE));
+	printf("Reloaded control store from %s at cycle %d, state %d\n\n", ucode_filename,
+	       lc3b_cycles(MACHINE), lc3b_get_reg(MACHINE, LC3B_STATE_NUMBER));
     }
-
-    ii = 0;
-    while (fscanf(prog, "%x\n", &word) != EOF) {
-	/* Make sure it fits. */
-	if (program_base + ii >= WORDS_IN_MEM) {
-	    printf("Error: Program file %s is too long to fit in memory. %x\n",
-		   program_filename, ii);
-	    exit(-1);
-	}
-
-	/* Write the word to memory array. */
-	MEMORY[program_base + ii][0] = word & 0x00FF;
-	MEMORY[program_base + ii][1] = (word >> 8) & 0x00FF;
-	ii++;
-    }
-
-    if (CURRENT_LATCHES.PC == 0) CURRENT_LATCHES.PC = (program_base << 1);
-
-    printf("Read %d words from program into memory.\n\n", ii);
+    free(text);
 }
 
 /***************************************************************/
 /*                                                             */
 /* Procedure : initialize                                      */
 /*                                                             */
-/* Purpose   : Load microprogram and machine language program  */ 
+/* Purpose   : Load microprogram and machine language program  */
 /*             and set up initial state of the machine.        */
 /*                                                             */
 /***************************************************************/
-void initialize(char *ucode_filename, char *program_filename, int num_prog_files) { 
-    int i;
-    init_control_store(ucode_filename);
+void initialize(char *memory_spec, char *ucode_filename, char *program_filename, int num_prog_files) {
+    char *text;
+    size_t length;
+    int i, words;
 
-    init_memory();
-    for ( i = 0; i < num_prog_files; i++ ) {
-	load_program(program_filename);
-	while(*program_filename++ != '\0');
+    if ((MACHINE = lc3b_create()) == NULL) {
+	printf("Error: Can't allocate the machine\n");
+	exit(-1);
+    }
+
+    if (memory_spec != NULL) {
+	if (lc3b_set_memory(MACHINE, memory_spec) == LC3B_ERROR) {
+	    printf("Error: %s\n", lc3b_message(MACHINE));
+	    exit(-1);
+	}
+	printf("Memory timing: %s\n", lc3b_memory(MACHINE));
     }
-    CURRENT_LATCHES.Z = 1;
-    CURRENT_LATCHES.STATE_NUMBER = INITIAL_STATE_NUMBER;
-    memcpy(CURRENT_LATCHES.MICROINSTRUCTION, CONTROL_STORE[INITIAL_STATE_NUMBER], sizeof(int)*CONTROL_STORE_BITS);
 
-    NEXT_LATCHES = CURRENT_LATCHES;
+    printf("Loading Control Store from file: %s\n", ucode_filename);
+    if ((text = read_file(ucode_filename, "micro-code file", &length)) == NULL)
+	exit(-1);
+    if (lc3b_load_ucode(MACHINE, text, length) == LC3B_ERROR) {
+	printf("Error: %s: %s\n", ucode_filename, lc3b_message(MACHINE));
+	exit(-1);
+    }
+    if (lc3b_message(MACHINE)[0] != '\0')
+	printf("Warning: %s: %s\n", ucode_filename, lc3b_message(MACHINE));
+    free(text);
+    printf("\n");
 
-    RUN_BIT = TRUE;
+    for ( i = 0; i < num_prog_files; i++ ) {
+	if ((text = read_file(program_filename, "program file", &length)) == NULL)
+	    exit(-1);
+	if ((words = lc3b_load_program(MACHINE, text, length)) == LC3B_ERROR) {
+	    printf("Error: %s: %s\n", program_filename, lc3b_message(MACHINE));
+	    exit(-1);
+	}
+	free(text);
+	printf("Read %d words from program into memory.\n\n", words);
+	while(*program_filename++ != '\0');
+    }
 }
 
 /***************************************************************/
@@ -521,19 +753,27 @@ void initialize(char *ucode_filename, char *program_filename, int num_prog_files
 /* Procedure : main                                            */
 /*                                                             */
 /***************************************************************/
-int main(int argc, char *argv[]) {                              
+int main(int argc, char *argv[]) {
     FILE * dumpsim_file;
+    char *memory_spec = NULL;
+
+    if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+	memory_spec = argv[2];
+	argv[2] = argv[0];
+	argc -= 2;
+	argv += 2;
+    }
 
     /* Error Checking */
     if (argc < 3) {
-	printf("Error: usage: %s <micro_code_file> <program_file_1> <program_file_2> ...\n",
+	printf("Error: usage: %s [-m <memory_timing>] <micro_code_file> <program_file_1> <program_file_2> ...\n",
 	       argv[0]);
 	exit(1);
     }
 
     printf("LC-3b Simulator\n\n");
 
-    initialize(argv[1], argv[2], argc - 2);
+    initialize(memory_spec, argv[1], argv[2], argc - 2);
 
     if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
 	printf("Error: Can't open dumpsim file\n");
@@ -544,424 +784,3 @@ int main(int argc, char *argv[]) {
 	get_command(dumpsim_file);
 
 }
-
-/***************************************************************/
-/* --------- DO NOT MODIFY THE CODE ABOVE THIS LINE -----------*/
-/***************************************************************/
-
-/***************************************************************/
-/* You are allowed to use the following global variables in your
-   code. These are defined above.
-
-   CONTROL_STORE
-   MEMORY
-   BUS
-
-   CURRENT_LATCHES
-   NEXT_LATCHES
-
-   You may define your own local/global variables and functions.
-   You may use the functions to get at the control bits defined
-   above.
-
-   Begin your code here 	  			       */
-/***************************************************************/
-
-//         Xiaofei's Implementation starts from here
-
-//////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////
-///////////////////////// Variables //////////////////////////////
-
-int *x = & CURRENT_LATCHES.MICROINSTRUCTION[0];
-
-int WE1,WE0;
-
-int COUNT=0;
-
-int vALU, vMAR, vMDR, vSHF, vPC;
-
-
-//////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////
-//////////////// Addition Functions //////////////////////////////
-
-int Get_Bits(int value, int start, int end){
-  int result;
-  result = value >> end;
-  result = result % ( 1 << ( start - end + 1 ) );
-  return result; 
-}
-
-int SEXT(int value, int topbit){
-  int shift = sizeof(int)*8 - topbit; 
-  return (value << shift )>> shift;
-}
-
-int ZEXT(int value){
-return value & 0xFFFF;
-}
-
-int LSHF(int value, int amount){
-  return (value << amount) & 0xFFFF;
-}
-
-int RSHF(int value, int amount, int topbit ){
-  int mask;
-  mask = 1 << amount;
-  mask -= 1;
-  mask = mask << ( 16 -amount );
-  
-  return ((value >> amount) & ~mask) | ((topbit)?(mask):0); /* TBD */
-}
-
-/////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////
-
-void eval_micro_sequencer() {
-
-
-   int OPCODE = Get_Bits(CURRENT_LATCHES.IR,15,12);
-   
-
-   int IR_11 = Get_Bits(CURRENT_LATCHES.IR,11,11) ;
-
-   int J_BITS;
-
-   
-   int COND = GetCOND(x);
-   
-   
-   
-   switch(COND)
-   {
-     case 0:
-       J_BITS = GetJ(x);
-       break;
-     case 1:
-       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (x[J2]<<2) + (CURRENT_LATCHES.READY<<1) + x[J0];
-       break;
-     case 2:
-       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (CURRENT_LATCHES.BEN<<2) + (x[J1]<<1) + x[J0];
-       break;
-     case 3:
-       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (x[J2]<<2) + (x[J1]<<1) + IR_11;
-       break;
-       
-     default: break;
-   }
-
-
-   int MUX[2];
-   MUX[0] = J_BITS;
-   MUX[1] = OPCODE;
-
-   int ROW = MUX[GetIRD(x)]; 
-   
-   
-   NEXT_LATCHES.STATE_NUMBER = ROW;
-   
-   int i=0;
-   for(i=0;i<35;i++)
-   {
-     NEXT_LATCHES.MICROINSTRUCTION[i] = CONTROL_STORE[ROW][i];
-   }
-   
-}
-
-
-void cycle_memory() 
-{   
-    NEXT_LATCHES.READY = 0;
-    if(GetMIO_EN(x) == 1)
-    {
-	  // Write
-	  if (GetR_W(x)== 1 )
-	  {
-	      COUNT += 1;
-	      if ( COUNT == 4 )
-	      {
-		  NEXT_LATCHES.READY = 1;   
-	      }
-	      else if( COUNT == 5)
-	      {
-		  MEM_WRITE();
-		  COUNT = 0;
-	      }
-
-	  }
-	  
-	  //READ
-	  if(GetR_W(x) == 0 )
-	  {
-	      COUNT += 1;
-	      if ( COUNT ==4 )	  
-	      {
-		  NEXT_LATCHES.READY = 1;   
-
-	      }
-	      else if( COUNT == 5)
-	      {
-		NEXT_LATCHES.MDR = MEM_READ();
-		COUNT = 0;
-	      }
-
-	  }
-    }
-}
-
-
-void eval_bus_drivers() {
-
-    vALU = GET_ALU_RESULT();
-    
-
-    vPC = CURRENT_LATCHES.PC;
-    
-
-    vSHF = GET_SHF_RESULT();
-    
-    vMDR = CURRENT_LATCHES.MDR;
-
-  
-    vMAR = GET_MAR_RESULT();
-  
-}
-
-
-void drive_bus() {
-
-    int ALU_BOX[2] = {0,vALU};
-    int PC_BOX[2]  = {0,vPC};
-    int SHF_BOX[2] = {0,vSHF};
-    int MDR_BOX[2] = {0,vMDR};
-    int MAR_BOX[2] = {0,vMAR};
-
-    BUS = ALU_BOX[GetGATE_ALU(x)] + 
-          PC_BOX[GetGATE_PC(x)]   + 
-          SHF_BOX[GetGATE_SHF(x)] + 
-          MDR_BOX[GetGATE_MDR(x)] +
-          MAR_BOX[GetGATE_MARMUX(x)];
-	  
-	//  printf("bus%d,\n",BUS);
-}
-
-
-void latch_datapath_values() {
-
-    //MAR    
-    int BUS_MAR[2] = { CURRENT_LATCHES.MAR, BUS };
-    NEXT_LATCHES.MAR = BUS_MAR[GetLD_MAR(x)];
-
-    //PC
-    int BUS_PC[2] = { CURRENT_LATCHES.PC, GET_PC_RESULT() };
-    NEXT_LATCHES.PC = BUS_PC[GetLD_PC(x)];
-
-  
-    //IR
-    int BUS_IR[2] = { CURRENT_LATCHES.IR, BUS};
-    NEXT_LATCHES.IR = BUS_IR[GetLD_IR(x)];
-
-
-  if(GetLD_CC(x)){
-   NEXT_LATCHES.N=0;
-  NEXT_LATCHES.Z=0;
-  NEXT_LATCHES.P=0;
-  if ( BUS == 0 )      NEXT_LATCHES.Z=1;
-  else if ( BUS & 0x8000 )  NEXT_LATCHES.N=1;
-  else                   NEXT_LATCHES.P=1;
-  }
-    //BEN
-    if(GetLD_BEN(x))
-    {
-      NEXT_LATCHES.BEN = GETBEN();
-    }
-    
-    //MDR
-    if(GetMIO_EN(x) == 0)
-    {
-      	  int MDR_MUX[2];
-	  MDR_MUX[0] = CURRENT_LATCHES.MDR;
-	  MDR_MUX[1] = BUS;
-	  NEXT_LATCHES.MDR = MDR_MUX[GetLD_MDR(x)];
-    }
-
-    //REG
-    if(GetLD_REG(x))
-    {
-        int DR_MUX[2];
-
-        DR_MUX[0] = Get_Bits(CURRENT_LATCHES.IR,11,9);
-        DR_MUX[1] = 7;
-
-        int DR_ADDR = DR_MUX[GetDRMUX(x)];
-        NEXT_LATCHES.REGS[DR_ADDR] = BUS;
-    }
-}
-
-
-//////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////
-///////////////////////////////// Routines ///////////////////////////////////
-
-int GET_ALU_RESULT()
-{
-   int ALU_MUX[4];
-    
-   int SR1_MUX[2];
-
-   SR1_MUX[0] = Get_Bits(CURRENT_LATCHES.IR,11,9);
-   SR1_MUX[1] = Get_Bits(CURRENT_LATCHES.IR,8,6);
-   int SR1_ADDR = SR1_MUX[GetSR1MUX(x)];
-
-   int SR2MUX[2];
-   int IR_5 = Get_Bits(CURRENT_LATCHES.IR,5,5);
-   int SR2_ADDR = Get_Bits(CURRENT_LATCHES.IR,2,0);
-   int imm5 = Get_Bits(CURRENT_LATCHES.IR,4,0);
-   SR2MUX[0] = CURRENT_LATCHES.REGS[SR2_ADDR];
-   SR2MUX[1] = SEXT(imm5,5);
-
-   int A = CURRENT_LATCHES.REGS[SR1_ADDR];
-   int B = SR2MUX[IR_5];
-
-    ALU_MUX[0] = A + B;
-    ALU_MUX[1] = A & B;
-    ALU_MUX[2] = A ^ B;
-    ALU_MUX[3] = A;
-
-    return Low16bits(ALU_MUX[GetALUK(x)]);
-}
-
-int GET_PC_RESULT()
-{
-    int MUX[3];
-
-    MUX[0] = CURRENT_LATCHES.PC + 2;
-    MUX[1] = BUS;
-    MUX[2] = GET_ADDRESS_ADDER();
-
-    return Low16bits(MUX[GetPCMUX(x)]);
-
-}
-
-int GET_MAR_RESULT()
-{
-    int MUX[2];
-
-    MUX[0] = LSHF( ZEXT(Get_Bits(CURRENT_LATCHES.IR,7,0)),1);
-    
-    MUX[1] = GET_ADDRESS_ADDER();
-
-    return  Low16bits(MUX[GetMARMUX(x)]);
-
-}
-
-int GET_MDR_RESULT()
-{
-    return CURRENT_LATCHES.MDR;
-}
-
-int GET_SHF_RESULT()
-{
-    int amount4 = Get_Bits(CURRENT_LATCHES.IR,3,0);
-    int IR_5 = Get_Bits(CURRENT_LATCHES.IR,5,5);
-    int IR_4 = Get_Bits(CURRENT_LATCHES.IR,4,4);
-    int SR_ADDR = Get_Bits(CURRENT_LATCHES.IR,8,6);
-    int SR = CURRENT_LATCHES.REGS[SR_ADDR];
-    int SR_topbit = SR>>15;
-    int SHF_CONTROL = (IR_5<<1) + (IR_4);
-
-    int MUX[4];
-
-    MUX[0] = LSHF(SR,amount4);              // SHFL
-    MUX[1] = RSHF(SR,amount4,0);            // RSHFL
-    MUX[2] = 0;                             // No this condition
-    MUX[3] = RSHF(SR,amount4,SR_topbit);    // RSHFA
-
-    return Low16bits(MUX[SHF_CONTROL]);
-
-}
-
-
-int GET_ADDRESS_ADDER()
-{
-    int ADDR_ADDER_IN_1;
-    int ADDR_ADDER_IN_2;
-
-    // IN_1
-    int R1_MUX[2];
-
-    int BaseR_ADDR = Get_Bits(CURRENT_LATCHES.IR,8,6);
-    int BaseR = CURRENT_LATCHES.REGS[BaseR_ADDR];
-
-    R1_MUX[0] = CURRENT_LATCHES.PC;
-    R1_MUX[1] = BaseR;
-
-    // IN_2
-    int R2_MUX[4];
-
-    int ZERO = 0;
-    int offset6 = SEXT(Get_Bits(CURRENT_LATCHES.IR,5,0),6);
-    int offset9 = SEXT(Get_Bits(CURRENT_LATCHES.IR,8,0),9);
-    int offset11 = SEXT(Get_Bits(CURRENT_LATCHES.IR,10,0),11);
-
-    R2_MUX[0] = ZERO;
-    R2_MUX[1] = offset6;
-    R2_MUX[2] = offset9;
-    R2_MUX[3] = offset11;
-
-    int LSHF1 = LSHF(R2_MUX[GetADDR2MUX(x)],GetLSHF1(x));
-    
-    ADDR_ADDER_IN_1 = LSHF1;
-    ADDR_ADDER_IN_2 = R1_MUX[GetADDR1MUX(x)];
-
-    return Low16bits(ADDR_ADDER_IN_1 + ADDR_ADDER_IN_2);
-}
-
-int GETBEN()
-{
-    int IR_11 = Get_Bits(CURRENT_LATCHES.IR,11,11);
-    int IR_10 = Get_Bits(CURRENT_LATCHES.IR,10,10);
-    int IR_9  = Get_Bits(CURRENT_LATCHES.IR, 9, 9);
-    int IR_15_12 = Get_Bits(CURRENT_LATCHES.IR, 15,12);
-
-    int BEN1 = (IR_11 & CURRENT_LATCHES.N)+
-              (IR_10 & CURRENT_LATCHES.Z)+
-              (IR_9 & CURRENT_LATCHES.P);
-    return BEN1;
-}
-
-int MEM_READ()
-{
-  int addr = CURRENT_LATCHES.MAR;
-  int bank=addr&1;
-  
-  if(GetDATA_SIZE(x)==1)
-  {
-    return MEMORY[addr>>1][1]<<8 | MEMORY[addr>>1][0];
-  }
-  if(GetDATA_SIZE(x)==0)
-  {
-    return Low16bits(SEXT(MEMORY[addr>>1][bank],8));
-  }
-}
-
-int MEM_WRITE()
-{
-  int addr = CURRENT_LATCHES.MAR;
-  int bank=addr&1;
-  
-  if(GetDATA_SIZE(x)==0)
-  {
-    MEMORY[addr>>1][bank]= CURRENT_LATCHES.MDR & 0xFF;
-  }
-  
-  if(GetDATA_SIZE(x)==1)
-  {
-    MEMORY[addr>>1][1] = (CURRENT_LATCHES.MDR & 0x0000FF00) >> 8;
-    MEMORY[addr>>1][0] = CURRENT_LATCHES.MDR & 0xFF;
-  }
-  return 0;
-}
@@ -0,0 +1,240 @@
+/***************************************************************/
+/*                                                             */
+/* lc3bdump - convert and compare LC-3b binary dumps           */
+/*                                                             */
+/* Usage: lc3bdump text <dump_file>                            */
+/*        lc3bdump diff <dump_file_1> <dump_file_2>            */
+/*                                                             */
+/* text prints every record in the same format as rdump and    */
+/* mdump. diff replays the records of both files into a        */
+/* memory image and reports the latches and words that differ  */
+/* between the final states.                                   */
+/*                                                             */
+/***************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "lc3bdump.h"
+
+#define WORDS_IN_MEM 0x08000
+#define LC_3b_REGS   8
+
+/***************************************************************/
+/* State rebuilt from a dump file.                             */
+/***************************************************************/
+typedef struct Dump_State_Struct {
+    int CYCLE;
+    int LATCHES[DUMP_LATCH_WORDS];
+    int MEMORY[WORDS_IN_MEM];
+    unsigned char KNOWN[WORDS_IN_MEM];	/* word appeared in some record */
+    int RECORDS;
+} Dump_State;
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : read_record                                     */
+/*                                                             */
+/* Purpose   : Read the next record of a dump file into state, */
+/*             calling show for every word it contains. Returns */
+/*             the record kind, or -1 at the end of the file.  */
+/*                                                             */
+/***************************************************************/
+int read_record(FILE * dump_file, char *dump_filename, Dump_State *state,
+		void (*show)(int address, int value)) {
+    unsigned char header[DUMP_HEADER_BYTES], body[6], entry[4];
+    int kind, k, i, start, count, address, value;
+
+    if (fread(header, 1, sizeof(header), dump_file) != sizeof(header))
+	return -1;
+
+    if (memcmp(header, DUMP_MAGIC, 4) != 0 || dump_get16(header + 4) != DUMP_VERSION) {
+	printf("Error: %s is not a version %d LC-3b dump\n", dump_filename, DUMP_VERSION);
+	exit(-1);
+    }
+
+    kind = dump_get16(header + 6);
+    state->CYCLE = dump_get32(header + 8);
+    for (k = 0; k < DUMP_LATCH_WORDS; k++)
+	state->LATCHES[k] = dump_get16(header + 12 + 2*k);
+
+    if (kind == DUMP_FULL) {
+	if (fread(body, 1, 6, dump_file) != 6) {
+	    printf("Error: Truncated record in %s\n", dump_filename);
+	    exit(-1);
+	}
+	start = dump_get16(body);
+	count = dump_get32(body + 2);
+	for (i = 0; i < count; i++) {
+	    if (fread(entry, 1, 2, dump_file) != 2 || start + i >= WORDS_IN_MEM) {
+		printf("Error: Truncated record in %s\n", dump_filename);
+		exit(-1);
+	    }
+	    state->MEMORY[start + i] = dump_get16(entry);
+	    state->KNOWN[start + i] = 1;
+	    if (show) show(start + i, state->MEMORY[start + i]);
+	}
+    }
+    else if (kind == DUMP_INCREMENTAL) {
+	if (fread(body, 1, 4, dump_file) != 4) {
+	    printf("Error: Truncated record in %s\n", dump_filename);
+	    exit(-1);
+	}
+	count = dump_get32(body);
+	for (i = 0; i < count; i++) {
+	    if (fread(entry, 1, 4, dump_file) != 4 ||
+		(address = dump_get16(entry)) >= WORDS_IN_MEM) {
+		printf("Error: Truncated record in %s\n", dump_filename);
+		exit(-1);
+	    }
+	    value = dump_get16(entry + 2);
+	    state->MEMORY[address] = value;
+	    state->KNOWN[address] = 1;
+	    if (show) show(address, value);
+	}
+    }
+    else {
+	printf("Error: Unknown record kind %d in %s\n", kind, dump_filename);
+	exit(-1);
+    }
+
+    state->RECORDS++;
+    return kind;
+}
+
+FILE * open_dump(char *dump_filename) {
+    FILE * dump_file;
+
+    if ((dump_file = fopen(dump_filename, "rb")) == NULL) {
+	printf("Error: Can't open dump file %s\n", dump_filename);
+	exit(-1);
+    }
+    return dump_file;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : print_latches                                   */
+/*                                                             */
+/* Purpose   : Print latches in the format used by rdump.      */
+/*                                                             */
+/***************************************************************/
+void print_latches(Dump_State *state) {
+    int k;
+
+    printf("\nCurrent register/bus values :\n");
+    printf("-------------------------------------\n");
+    printf("Cycle Count  : %d\n", state->CYCLE);
+    printf("PC           : 0x%04x\n", state->LATCHES[DUMP_PC]);
+    printf("IR           : 0x%04x\n", state->LATCHES[DUMP_IR]);
+    printf("STATE_NUMBER : 0x%04x\n\n", state->LATCHES[DUMP_STATE_NUMBER]);
+    printf("BUS          : 0x%04x\n", state->LATCHES[DUMP_BUS]);
+    printf("MDR          : 0x%04x\n", state->LATCHES[DUMP_MDR]);
+    printf("MAR          : 0x%04x\n", state->LATCHES[DUMP_MAR]);
+    printf("CCs: N = %d  Z = %d  P = %d\n", state->LATCHES[DUMP_N], state->LATCHES[DUMP_Z], state->LATCHES[DUMP_P]);
+    printf("Registers:\n");
+    for (k = 0; k < LC_3b_REGS; k++)
+	printf("%d: 0x%04x\n", k, state->LATCHES[DUMP_R0 + k]);
+    printf("\n");
+}
+
+void show_word(int address, int value) {
+    printf("  0x%04x (%d) : 0x%04x\n", address << 1, address << 1, value);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : text                                            */
+/*                                                             */
+/* Purpose   : Print every record of a dump file as text.      */
+/*                                                             */
+/***************************************************************/
+void text(char *dump_filename) {
+    FILE * dump_file = open_dump(dump_filename);
+    static Dump_State state;
+    long position;
+    unsigned char header[DUMP_HEADER_BYTES];
+    int k;
+
+    while (1) {
+	/* Print the latches before the words they were dumped with. */
+	position = ftell(dump_file);
+	if (fread(header, 1, sizeof(header), dump_file) != sizeof(header))
+	    break;
+	fseek(dump_file, position, SEEK_SET);
+
+	state.CYCLE = dump_get32(header + 8);
+	for (k = 0; k < DUMP_LATCH_WORDS; k++)
+	    state.LATCHES[k] = dump_get16(header + 12 + 2*k);
+	print_latches(&state);
+
+	printf("%s :\n", dump_get16(header + 6) == DUMP_FULL ?
+	       "Memory content" : "Memory written since previous incremental dump");
+	printf("-------------------------------------\n");
+	read_record(dump_file, dump_filename, &state, show_word);
+	printf("\n");
+    }
+    fclose(dump_file);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : diff                                            */
+/*                                                             */
+/* Purpose   : Compare the final states of two dump files.     */
+/*             Returns the number of differences.              */
+/*                                                             */
+/***************************************************************/
+int diff(char *filename1, char *filename2) {
+    static Dump_State a, b;
+    static const char *names[DUMP_LATCH_WORDS] = {
+	"PC", "IR", "STATE_NUMBER", "BUS", "MDR", "MAR", "N", "Z", "P", "BEN",
+	"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7"
+    };
+    FILE * file1 = open_dump(filename1);
+    FILE * file2 = open_dump(filename2);
+    int k, differences = 0;
+
+    while (read_record(file1, filename1, &a, NULL) >= 0);
+    while (read_record(file2, filename2, &b, NULL) >= 0);
+    fclose(file1);
+    fclose(file2);
+
+    printf("%s: %d records, cycle %d\n", filename1, a.RECORDS, a.CYCLE);
+    printf("%s: %d records, cycle %d\n\n", filename2, b.RECORDS, b.CYCLE);
+
+    for (k = 0; k < DUMP_LATCH_WORDS; k++)
+	if (a.LATCHES[k] != b.LATCHES[k]) {
+	    printf("%-12s : 0x%04x | 0x%04x\n", names[k], a.LATCHES[k], b.LATCHES[k]);
+	    differences++;
+	}
+
+    for (k = 0; k < WORDS_IN_MEM; k++) {
+	if (!a.KNOWN[k] && !b.KNOWN[k])
+	    continue;
+	if (a.KNOWN[k] != b.KNOWN[k])
+	    printf("  0x%04x (%d) : %s | %s\n", k << 1, k << 1,
+		   a.KNOWN[k] ? "known" : "not dumped", b.KNOWN[k] ? "known" : "not dumped");
+	else if (a.MEMORY[k] != b.MEMORY[k])
+	    printf("  0x%04x (%d) : 0x%04x | 0x%04x\n", k << 1, k << 1, a.MEMORY[k], b.MEMORY[k]);
+	else
+	    continue;
+	differences++;
+    }
+
+    printf("%d difference(s)\n", differences);
+    return differences;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "text") == 0) {
+	text(argv[2]);
+	return 0;
+    }
+    if (argc == 4 && strcmp(argv[1], "diff") == 0)
+	return diff(argv[2], argv[3]) ? 1 : 0;
+
+    printf("Error: usage: %s text <dump_file>\n"
+	   "              %s diff <dump_file_1> <dump_file_2>\n", argv[0], argv[0]);
+    exit(1);
+}
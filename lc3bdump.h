@@ -0,0 +1,53 @@
+/***************************************************************/
+/*                                                             */
+/* LC-3b binary dump format                                    */
+/*                                                             */
+/* Shared by the simulator (bdump/idump) and lc3bdump.         */
+/*                                                             */
+/***************************************************************/
+
+#ifndef LC3BDUMP_H
+#define LC3BDUMP_H
+
+#include <stdio.h>
+
+/***************************************************************/
+/* A dump file is a sequence of records, each written by one   */
+/* bdump or idump command. All fields are little endian.       */
+/*                                                             */
+/*   magic     4 bytes  "LC3D"                                 */
+/*   version   u16                                             */
+/*   kind      u16      DUMP_FULL or DUMP_INCREMENTAL          */
+/*   cycle     u32      CYCLE_COUNT at the time of the dump    */
+/*   latches   u16 x DUMP_LATCH_WORDS, in Dump_Latch order     */
+/*                                                             */
+/* DUMP_FULL is followed by                                    */
+/*   start     u16      first word address                     */
+/*   count     u32      number of words                        */
+/*   words     u16 x count                                     */
+/*                                                             */
+/* DUMP_INCREMENTAL is followed by                             */
+/*   count     u32      number of words written since the      */
+/*                      previous incremental dump              */
+/*   entries   (u16 word address, u16 value) x count           */
+/***************************************************************/
+#define DUMP_MAGIC       "LC3D"
+#define DUMP_VERSION     1
+#define DUMP_FULL        0
+#define DUMP_INCREMENTAL 1
+
+enum Dump_Latch {
+    DUMP_PC, DUMP_IR, DUMP_STATE_NUMBER, DUMP_BUS,
+    DUMP_MDR, DUMP_MAR, DUMP_N, DUMP_Z, DUMP_P, DUMP_BEN,
+    DUMP_R0, DUMP_R1, DUMP_R2, DUMP_R3, DUMP_R4, DUMP_R5, DUMP_R6, DUMP_R7,
+    DUMP_LATCH_WORDS
+};
+
+#define DUMP_HEADER_BYTES (12 + 2 * DUMP_LATCH_WORDS)
+
+static inline void dump_put16(unsigned char *p, int v) { p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; }
+static inline void dump_put32(unsigned char *p, int v) { dump_put16(p, v); dump_put16(p + 2, v >> 16); }
+static inline int  dump_get16(const unsigned char *p)  { return p[0] | (p[1] << 8); }
+static inline int  dump_get32(const unsigned char *p)  { return dump_get16(p) | (dump_get16(p + 2) << 16); }
+
+#endif
@@ -0,0 +1,362 @@
+/***************************************************************/
+/*                                                             */
+/* lc3bfuzz - fuzz the microcode and datapath                  */
+/*                                                             */
+/* Usage: lc3bfuzz [-c cycles] [-n runs] [-t seconds] [-s seed]*/
+/*                 [-o dir] <micro_code_file> [<program_file>] */
+/*                                                             */
+/* Loads the microcode and seed program once, then runs        */
+/* mutated instruction streams from that state with the        */
+/* library's snapshot restore, checking every instruction      */
+/* against the ISA reference model. Inputs that reach new      */
+/* microstate transitions or instruction addresses join the    */
+/* corpus. Each input that diverges in a new way is saved to   */
+/* dir in the assembler's format, written over the seed        */
+/* program so the file holds the whole initial memory, and the */
+/* simulator can load it with cosim on.                        */
+/*                                                             */
+/***************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lc3bsim.h"
+
+#define MAX_INPUT_WORDS 64
+#define MAX_CORPUS      4096
+#define MAX_FINDINGS    256
+
+/***************************************************************/
+/* An input is a short instruction stream.                     */
+/***************************************************************/
+typedef struct Input_Struct {
+    int WORDS[MAX_INPUT_WORDS];
+    int LENGTH;
+} Input;
+
+Input CORPUS[MAX_CORPUS];
+int CORPUS_SIZE;
+
+int *SEED;			/* the seed program as loaded, from the base PC */
+int SEED_LENGTH;
+
+char FINDINGS[MAX_FINDINGS][256];	/* kinds of divergence saved */
+int NUM_FINDINGS;
+
+unsigned long long RANDOM_STATE = 1;
+
+unsigned random_next() {
+    RANDOM_STATE ^= RANDOM_STATE << 13;
+    RANDOM_STATE ^= RANDOM_STATE >> 7;
+    RANDOM_STATE ^= RANDOM_STATE << 17;
+    return (unsigned)(RANDOM_STATE >> 16);
+}
+
+#define RANDOM(n) ((int)(random_next() % (n)))
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : interesting_instruction                         */
+/*                                                             */
+/* Purpose   : Make an instruction aimed at the corners of the */
+/*             datapath: shifts of every kind and amount, byte */
+/*             and word accesses at odd and extreme offsets,   */
+/*             subroutine calls through R7, traps and the      */
+/*             unused opcodes.                                 */
+/*                                                             */
+/***************************************************************/
+int interesting_instruction() {
+    static const int offset6[] = { 0, 1, -1, 31, -32, 3, -3 };
+    static const int offset11[] = { 0, 1, -1, 1023, -1024, -2 };
+    static const int trapvect8[] = { 0x00, 0x20, 0x25, 0x7F, 0x80, 0xFF };
+    static const int imm5[] = { 0x00, 0x0F, 0x10, 0x1F };
+    static const int operate[] = { 0x1000, 0x5000, 0x9000 };
+    static const int reserved[] = { 0x8000, 0xA000, 0xB000 };
+    int dr = RANDOM(8), sr = RANDOM(8);
+
+    switch (RANDOM(10)) {
+    case 0:			/* SHF, including the unused mode 10 */
+	return 0xD000 | dr << 9 | sr << 6 | RANDOM(4) << 4 |
+	    (RANDOM(2) ? RANDOM(16) : (RANDOM(2) ? 15 : 0));
+    case 1:			/* LDB, STB */
+	return (RANDOM(2) ? 0x2000 : 0x3000) | dr << 9 | sr << 6 | (offset6[RANDOM(7)] & 0x3F);
+    case 2:			/* LDW, STW */
+	return (RANDOM(2) ? 0x6000 : 0x7000) | dr << 9 | sr << 6 | (offset6[RANDOM(7)] & 0x3F);
+    case 3:			/* JSR */
+	return 0x4800 | (offset11[RANDOM(6)] & 0x7FF);
+    case 4:			/* JSRR, often through R7 */
+	return 0x4000 | (RANDOM(2) ? 7 : sr) << 6;
+    case 5:			/* TRAP */
+	return 0xF000 | trapvect8[RANDOM(6)];
+    case 6:			/* JMP, RET */
+	return 0xC000 | (RANDOM(2) ? 7 : sr) << 6;
+    case 7:			/* BR with any condition, short hops */
+	return RANDOM(8) << 9 | (offset6[RANDOM(7)] & 0x1FF);
+    case 8:			/* ADD, AND, XOR with extreme immediates */
+	return operate[RANDOM(3)] | dr << 9 | sr << 6 | 0x20 | imm5[RANDOM(4)];
+    default:			/* RTI and the reserved opcodes */
+	return reserved[RANDOM(3)] | RANDOM(0x1000);
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : mutate                                          */
+/*                                                             */
+/* Purpose   : Apply a few random changes to an input.         */
+/*                                                             */
+/***************************************************************/
+void mutate(Input *input) {
+    int k, i, j, n, changes = 1 + RANDOM(4);
+    Input *other;
+
+    for (k = 0; k < changes; k++) {
+	if (input->LENGTH == 0) {
+	    input->WORDS[input->LENGTH++] = interesting_instruction();
+	    continue;
+	}
+	i = RANDOM(input->LENGTH);
+	switch (RANDOM(8)) {
+	case 0:
+	    input->WORDS[i] ^= 1 << RANDOM(16);
+	    break;
+	case 1:
+	    input->WORDS[i] = RANDOM(0x10000);
+	    break;
+	case 2:
+	case 3:
+	    input->WORDS[i] = interesting_instruction();
+	    break;
+	case 4:			/* insert */
+	    if (input->LENGTH == MAX_INPUT_WORDS)
+		break;
+	    memmove(&input->WORDS[i + 1], &input->WORDS[i], (input->LENGTH - i) * sizeof(int));
+	    input->WORDS[i] = interesting_instruction();
+	    input->LENGTH++;
+	    break;
+	case 5:			/* delete */
+	    memmove(&input->WORDS[i], &input->WORDS[i + 1], (input->LENGTH - i - 1) * sizeof(int));
+	    input->LENGTH--;
+	    break;
+	case 6:			/* swap */
+	    j = RANDOM(input->LENGTH);
+	    n = input->WORDS[i];
+	    input->WORDS[i] = input->WORDS[j];
+	    input->WORDS[j] = n;
+	    break;
+	default:		/* splice in part of another input */
+	    other = &CORPUS[RANDOM(CORPUS_SIZE)];
+	    if (other->LENGTH == 0)
+		break;
+	    j = RANDOM(other->LENGTH);
+	    n = 1 + RANDOM(other->LENGTH - j);
+	    if (i + n > MAX_INPUT_WORDS)
+		n = MAX_INPUT_WORDS - i;
+	    memcpy(&input->WORDS[i], &other->WORDS[j], n * sizeof(int));
+	    if (i + n > input->LENGTH)
+		input->LENGTH = i + n;
+	    break;
+	}
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : save_finding                                    */
+/*                                                             */
+/* Purpose   : Save an input that diverged, unless a saved one */
+/*             diverged the same way: on the same opcode, in   */
+/*             the same fields. The rest of the seed program   */
+/*             follows the input, so the file alone recreates  */
+/*             the run's initial state.                        */
+/*                                                             */
+/***************************************************************/
+void save_finding(Input *input, int address, const char *report, char *directory) {
+    char kind[256], filename[512];
+    const char *fields, *ir;
+    FILE *file;
+    int i, n;
+
+    ir = strstr(report, "IR 0x");
+    fields = strchr(report, '\n');
+    n = snprintf(kind, sizeof(kind), "%c", ir ? ir[5] : '?');
+    for (; fields && *fields && n < (int)sizeof(kind) - 2; fields++)
+	if (*fields == '\n' && fields[1] == ' ') {
+	    kind[n++] = fields[3];	/* PC, IR, DR, CCs, Store, Next PC */
+	    kind[n++] = fields[4];
+	}
+    kind[n] = '\0';
+
+    for (i = 0; i < NUM_FINDINGS; i++)
+	if (strcmp(FINDINGS[i], kind) == 0)
+	    return;
+    if (NUM_FINDINGS == MAX_FINDINGS)
+	return;
+    strcpy(FINDINGS[NUM_FINDINGS++], kind);
+
+    snprintf(filename, sizeof(filename), "%s/diverged-%d.hex", directory, NUM_FINDINGS);
+    if ((file = fopen(filename, "w")) == NULL) {
+	printf("Error: Can't write %s\n", filename);
+	return;
+    }
+    fprintf(file, "0x%04X\n", address);
+    for (i = 0; i < input->LENGTH || i < SEED_LENGTH; i++)
+	fprintf(file, "0x%04X\n", (i < input->LENGTH ? input->WORDS[i] : SEED[i]) & 0xFFFF);
+    fclose(file);
+
+    printf("\n%s%s\n", report, filename);
+}
+
+/* Read a whole file into memory, or exit. */
+char *read_file(char *filename, size_t *length) {
+    FILE *file;
+    char *text = NULL;
+    size_t size = 0;
+
+    if ((file = fopen(filename, "r")) == NULL) {
+	printf("Error: Can't open %s\n", filename);
+	exit(-1);
+    }
+    do {
+	if ((text = realloc(text, size + 4096)) == NULL) {
+	    printf("Error: Can't read %s\n", filename);
+	    exit(-1);
+	}
+	size += fread(text + size, 1, 4096, file);
+    } while (!feof(file) && !ferror(file));
+    fclose(file);
+
+    *length = size;
+    return text;
+}
+
+void usage(char *name) {
+    printf("Error: usage: %s [-c cycles] [-n runs] [-t seconds] [-s seed] [-o dir]\n"
+	   "              <micro_code_file> [<program_file>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    lc3b_machine *m;
+    lc3b_fuzz_result result;
+    unsigned char bytes[2 * MAX_INPUT_WORDS];
+    Input input;
+    char *text, *directory = ".", *name = argv[0];
+    size_t length;
+    long long runs = 0, max_runs = 0, halted = 0, timeouts = 0, diverged = 0;
+    double seconds = 0, start, last;
+    int max_cycles = 1000, address, words = 0, states, pcs, i;
+
+    for (; argc > 2 && argv[1][0] == '-'; argc -= 2, argv += 2) {
+	if (strcmp(argv[1], "-c") == 0)
+	    max_cycles = atoi(argv[2]);
+	else if (strcmp(argv[1], "-n") == 0)
+	    max_runs = atoll(argv[2]);
+	else if (strcmp(argv[1], "-t") == 0)
+	    seconds = atof(argv[2]);
+	else if (strcmp(argv[1], "-s") == 0)
+	    RANDOM_STATE = strtoull(argv[2], NULL, 0) | 1;
+	else if (strcmp(argv[1], "-o") == 0)
+	    directory = argv[2];
+	else
+	    usage(name);
+    }
+    if (argc < 2 || argc > 3 || max_cycles < 1)
+	usage(name);
+
+    if ((m = lc3b_create()) == NULL) {
+	printf("Error: Can't allocate the machine\n");
+	exit(-1);
+    }
+    text = read_file(argv[1], &length);
+    if (lc3b_load_ucode(m, text, length) == LC3B_ERROR) {
+	printf("Error: %s: %s\n", argv[1], lc3b_message(m));
+	exit(-1);
+    }
+    free(text);
+
+    /* The seed program is the first input; without one, start at x3000. */
+    if (argc == 3) {
+	text = read_file(argv[2], &length);
+	if ((words = lc3b_load_program(m, text, length)) == LC3B_ERROR) {
+	    printf("Error: %s: %s\n", argv[2], lc3b_message(m));
+	    exit(-1);
+	}
+	free(text);
+    }
+    else
+	lc3b_set_reg(m, LC3B_PC, 0x3000);
+    address = lc3b_get_reg(m, LC3B_PC);
+
+    if ((SEED = malloc((words + 1) * sizeof(int))) == NULL) {
+	printf("Error: Can't allocate the seed program\n");
+	exit(-1);
+    }
+    for (i = 0; i < words; i++)
+	SEED[i] = lc3b_read_word(m, address + 2*i);
+    SEED_LENGTH = words;
+
+    CORPUS[0].LENGTH = words < MAX_INPUT_WORDS ? words : MAX_INPUT_WORDS;
+    memcpy(CORPUS[0].WORDS, SEED, CORPUS[0].LENGTH * sizeof(int));
+    CORPUS_SIZE = 1;
+
+    if (lc3b_fuzz_start(m) == LC3B_ERROR) {
+	printf("Error: %s\n", lc3b_message(m));
+	exit(-1);
+    }
+
+    printf("Fuzzing from PC 0x%04x, %d cycles per run\n", address, max_cycles);
+    start = last = now();
+    while (max_runs == 0 || runs < max_runs) {
+	input = CORPUS[RANDOM(CORPUS_SIZE)];
+	if (runs > 0)
+	    mutate(&input);
+	for (i = 0; i < input.LENGTH; i++) {
+	    bytes[2*i] = input.WORDS[i] & 0xFF;
+	    bytes[2*i + 1] = (input.WORDS[i] >> 8) & 0xFF;
+	}
+
+	lc3b_fuzz_run(m, bytes, 2 * input.LENGTH, max_cycles, &result);
+	runs++;
+
+	if (result.status == LC3B_DIVERGED) {
+	    diverged++;
+	    save_finding(&input, address, lc3b_cosim_report(m), directory);
+	}
+	else if (result.status == LC3B_HALTED)
+	    halted++;
+	else
+	    timeouts++;
+	if ((result.new_states || result.new_pcs) && CORPUS_SIZE < MAX_CORPUS)
+	    CORPUS[CORPUS_SIZE++] = input;
+
+	if ((runs & 1023) == 0 && now() - last >= 1) {
+	    last = now();
+	    lc3b_fuzz_coverage(m, &states, &pcs);
+	    printf("%lld runs, %.0f/s, corpus %d, %d transitions, %d PCs, %lld diverged\n",
+		   runs, runs / (last - start), CORPUS_SIZE, states, pcs, diverged);
+	    fflush(stdout);
+	    if (seconds > 0 && last - start >= seconds)
+		break;
+	}
+    }
+
+    last = now();
+    lc3b_fuzz_coverage(m, &states, &pcs);
+    printf("\n%lld runs in %.1f s, %.0f runs/s\n", runs, last - start, runs / (last - start));
+    printf("%lld halted, %lld out of cycles, %lld diverged (%d kinds saved)\n",
+	   halted, timeouts, diverged, NUM_FINDINGS);
+    printf("Coverage: %d microstate transitions, %d instruction addresses, corpus %d\n",
+	   states, pcs, CORPUS_SIZE);
+
+    lc3b_destroy(m);
+    free(SEED);
+    return NUM_FINDINGS ? 1 : 0;
+}
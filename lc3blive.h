@@ -0,0 +1,68 @@
+/***************************************************************/
+/*                                                             */
+/* LC-3b live statistics page                                  */
+/*                                                             */
+/* Shared by the simulator (live) and lc3btop.                 */
+/*                                                             */
+/***************************************************************/
+
+#ifndef LC3BLIVE_H
+#define LC3BLIVE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/***************************************************************/
+/* A live statistics file holds one Live_Page, mapped shared   */
+/* by the simulator that writes it and by any number of        */
+/* readers. The writer makes SEQUENCE odd, updates the fields  */
+/* and makes it even again; a reader that sees SEQUENCE odd or */
+/* changed across its copy retries. Fields are native endian,  */
+/* so readers run on the same host.                            */
+/***************************************************************/
+#define LIVE_MAGIC   "LC3L"
+#define LIVE_VERSION 1
+
+enum Live_Status {
+    LIVE_RUNNING,		/* being stepped */
+    LIVE_IDLE,			/* waiting, e.g. at the prompt */
+    LIVE_HALTED,
+    LIVE_DIVERGED,		/* co-simulation found a mismatch */
+    LIVE_DETACHED		/* no longer published */
+};
+
+typedef struct Live_Page_Struct {
+    char MAGIC[4];
+    uint32_t VERSION;
+    uint32_t SEQUENCE;		/* odd while an update is in progress */
+    uint32_t PID;
+    uint32_t STATUS;		/* enum Live_Status */
+    uint32_t PC, STATE_NUMBER;
+    uint32_t INTERVAL;		/* cycles between updates */
+    uint64_t CYCLES, INSTRUCTIONS;
+    uint64_t MEM_READS, MEM_WRITES;
+    double CYCLES_PER_SECOND;	/* over the last interval */
+    uint64_t UPDATED_NS;	/* CLOCK_REALTIME of the update */
+} Live_Page;
+
+/* Copy a consistent view of page into copy, retrying while it changes.
+   Returns 0 if no update finished in time, e.g. the writer was killed
+   in the middle of one. */
+static inline int live_read(const volatile Live_Page *page, Live_Page *copy) {
+    uint32_t before, after;
+    int tries;
+
+    for (tries = 0; tries < 100000; tries++) {
+	before = __atomic_load_n(&page->SEQUENCE, __ATOMIC_ACQUIRE);
+	if (before & 1)
+	    continue;
+	memcpy(copy, (const void *)page, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&page->SEQUENCE, __ATOMIC_RELAXED);
+	if (before == after)
+	    return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,3416 @@
+/***************************************************************/
+/*                                                             */
+/* LC-3b Simulator (Adapted from Prof. Yale Patt at UT Austin) */
+/*                                                             */
+/* The simulator core, built as a library. The API is in       */
+/* lc3bsim.h; Multicycle Microarchitecture.c is the shell.     */
+/*                                                             */
+/***************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "lc3bsim.h"
+#include "lc3bdump.h"
+#include "lc3blive.h"
+
+/***************************************************************/
+/* These are the functions you'll have to write.               */
+/***************************************************************/
+
+static void eval_micro_sequencer();
+static void cycle_memory();
+static void eval_bus_drivers();
+static void drive_bus();
+static void latch_datapath_values();
+
+/* Fill in the pre-decoded instruction table; see Decoded_IR. */
+static void decode_init();
+
+/***************************************************************/
+/* Lockstep co-simulation against the ISA reference model.     */
+/***************************************************************/
+static int  cosim_sync(lc3b_machine *m);
+static void cosim_stop(lc3b_machine *m);
+static void cosim_fetch();
+static void cosim_retire();
+
+/* One retired instruction as seen by the microarchitecture. */
+typedef struct Retire_Record_Struct {
+    int CYCLE,		/* cycle at which the instruction retired */
+	PC,		/* address the instruction was fetched from */
+	IR,		/* the instruction */
+	NEXT_PC,	/* PC after the instruction */
+	DR,		/* register written, -1 if none */
+	DR_VALUE,	/* value written to DR */
+	N, Z, P,	/* condition codes after the instruction */
+	MEM_SIZE,	/* 0 = no store, 1 = byte store, 2 = word store */
+	MEM_ADDR,	/* byte address of the store */
+	MEM_VALUE;	/* value stored */
+} Retire_Record;
+
+static _Thread_local int COSIM_ACTIVE;
+static _Thread_local Retire_Record COSIM_RECORD;
+
+/***************************************************************/
+/* Multi-core system mode.                                     */
+/***************************************************************/
+typedef struct System_Struct System;
+static int  bus_acquire();
+static _Thread_local System *SYSTEM;
+static void system_lock();
+static void system_unlock();
+
+/***************************************************************/
+/* Reverse execution.                                          */
+/***************************************************************/
+static void snapshot_take();
+static void snapshot_reset();
+static void undo_record(int word);
+static void history_edit(lc3b_machine *m, int word);
+static _Thread_local int NEXT_SNAPSHOT;
+static _Thread_local int SNAPSHOT_INTERVAL;
+static lc3b_machine *HISTORY_MACHINE;
+
+/***************************************************************/
+/* Trace recording for timing replay.                          */
+/***************************************************************/
+static void trace_cycle();
+static _Thread_local FILE *TRACE_FILE;
+
+/***************************************************************/
+/* Switching activity for energy estimates.                    */
+/***************************************************************/
+static void activity_cycle();
+static void activity_read(int value);
+static void activity_write(int word);
+static void activity_fold(lc3b_machine *m);
+
+/***************************************************************/
+/* A couple of useful definitions.                             */
+/***************************************************************/
+#define FALSE 0
+#define TRUE  1
+
+/***************************************************************/
+/* Use this to avoid overflowing 16 bits on the bus.           */
+/***************************************************************/
+#define Low16bits(x) ((x) & 0xFFFF)
+
+/***************************************************************/
+/* Definition of the control store layout.                     */
+/***************************************************************/
+#define CONTROL_STORE_ROWS 64
+#define INITIAL_STATE_NUMBER 18
+
+/***************************************************************/
+/* Definition of bit order in control store word.              */
+/***************************************************************/
+enum CS_BITS {                                                  
+    IRD,
+    COND1, COND0,
+    J5, J4, J3, J2, J1, J0,
+    LD_MAR,
+    LD_MDR,
+    LD_IR,
+    LD_BEN,
+    LD_REG,
+    LD_CC,
+    LD_PC,
+    GATE_PC,
+    GATE_MDR,
+    GATE_ALU,
+    GATE_MARMUX,
+    GATE_SHF,
+    PCMUX1, PCMUX0,
+    DRMUX,
+    SR1MUX,
+    ADDR1MUX,
+    ADDR2MUX1, ADDR2MUX0,
+    MARMUX,
+    ALUK1, ALUK0,
+    MIO_EN,
+    R_W,
+    DATA_SIZE,
+    LSHF1,
+    CONTROL_STORE_BITS
+};
+
+/***************************************************************/
+/* Functions to get at the control bits.                       */
+/***************************************************************/
+static int GetIRD(int *x)           { return(x[IRD]); }
+static int GetCOND(int *x)          { return((x[COND1] << 1) + x[COND0]); }
+static int GetJ(int *x)             { return((x[J5] << 5) + (x[J4] << 4) +
+				      (x[J3] << 3) + (x[J2] << 2) +
+				      (x[J1] << 1) + x[J0]); }
+static int GetLD_MAR(int *x)        { return(x[LD_MAR]); }
+static int GetLD_MDR(int *x)        { return(x[LD_MDR]); }
+static int GetLD_IR(int *x)         { return(x[LD_IR]); }
+static int GetLD_BEN(int *x)        { return(x[LD_BEN]); }
+static int GetLD_REG(int *x)        { return(x[LD_REG]); }
+static int GetLD_CC(int *x)         { return(x[LD_CC]); }
+static int GetLD_PC(int *x)         { return(x[LD_PC]); }
+static int GetGATE_PC(int *x)       { return(x[GATE_PC]); }
+static int GetGATE_MDR(int *x)      { return(x[GATE_MDR]); }
+static int GetGATE_ALU(int *x)      { return(x[GATE_ALU]); }
+static int GetGATE_MARMUX(int *x)   { return(x[GATE_MARMUX]); }
+static int GetGATE_SHF(int *x)      { return(x[GATE_SHF]); }
+static int GetPCMUX(int *x)         { return((x[PCMUX1] << 1) + x[PCMUX0]); }
+static int GetDRMUX(int *x)         { return(x[DRMUX]); }
+static int GetSR1MUX(int *x)        { return(x[SR1MUX]); }
+static int GetADDR1MUX(int *x)      { return(x[ADDR1MUX]); }
+static int GetADDR2MUX(int *x)      { return((x[ADDR2MUX1] << 1) + x[ADDR2MUX0]); }
+static int GetMARMUX(int *x)        { return(x[MARMUX]); }
+static int GetALUK(int *x)          { return((x[ALUK1] << 1) + x[ALUK0]); }
+static int GetMIO_EN(int *x)        { return(x[MIO_EN]); }
+static int GetR_W(int *x)           { return(x[R_W]); }
+static int GetDATA_SIZE(int *x)     { return(x[DATA_SIZE]); } 
+static int GetLSHF1(int *x)         { return(x[LSHF1]); }
+
+/***************************************************************/
+/* The control store rom.                                      */
+/***************************************************************/
+/* The control store, memory and write tracker below point into the
+   machine being simulated by the calling thread; see machine_enter. */
+static _Thread_local int (*CONTROL_STORE)[CONTROL_STORE_BITS];
+
+/* FETCH_STATE[row] is set for rows identical to the initial state; entering
+   one of them ends the current instruction. */
+static _Thread_local int *FETCH_STATE;
+
+/***************************************************************/
+/* Main memory.                                                */
+/***************************************************************/
+/* MEMORY[A][0] stores the least significant byte of word at word address A
+   MEMORY[A][1] stores the most significant byte of word at word address A 
+   There are two write enable signals, one for each byte. WE0 is used for 
+   the least significant byte of a word. WE1 is used for the most significant 
+   byte of a word. */
+
+#define WORDS_IN_MEM    0x08000 
+#define MEM_CYCLES      5
+static _Thread_local int (*MEMORY)[2];
+
+/* Words written since the last incremental dump, as a bitmap to filter
+   repeats and a list so the dump never has to scan all of memory. */
+typedef struct Write_Tracker_Struct {
+    unsigned MAP[WORDS_IN_MEM / 32];
+    int LIST[WORDS_IN_MEM];
+    int COUNT;
+} Write_Tracker;
+
+static _Thread_local Write_Tracker *WRITTEN;
+
+static void track_write(Write_Tracker *t, int word) {
+    unsigned bit = 1u << (word & 31);
+    if ((t->MAP[word >> 5] & bit) == 0) {
+	t->MAP[word >> 5] |= bit;
+	t->LIST[t->COUNT++] = word;
+    }
+}
+
+static void mark_written(int word) {
+    track_write(WRITTEN, word);
+}
+
+/***************************************************************/
+
+/***************************************************************/
+
+/***************************************************************/
+/* LC-3b State info.                                           */
+/***************************************************************/
+#define LC_3b_REGS 8
+
+/* Everything that belongs to one core is thread local, so that each core
+   of a multi-core system can be simulated on its own host thread. MEMORY
+   and the control store are shared. */
+static _Thread_local int RUN_BIT;	/* run bit */
+static _Thread_local int BUS;	/* value of the bus */
+
+typedef struct System_Latches_Struct{
+
+int PC,		/* program counter */
+    MDR,	/* memory data register */
+    MAR,	/* memory address register */
+    IR,		/* instruction register */
+    N,		/* n condition bit */
+    Z,		/* z condition bit */
+    P,		/* p condition bit */
+    BEN;        /* ben register */
+
+int READY;	/* ready bit */
+  /* The ready bit is also latched as you dont want the memory system to assert it 
+     at a bad point in the cycle*/
+
+int REGS[LC_3b_REGS]; /* register file. */
+
+int MICROINSTRUCTION[CONTROL_STORE_BITS]; /* The microintruction */
+
+int STATE_NUMBER; /* Current State Number - Provided for debugging */ 
+} System_Latches;
+
+/* Data Structure for Latch */
+
+static _Thread_local System_Latches CURRENT_LATCHES, NEXT_LATCHES;
+
+/***************************************************************/
+/* A cycle counter.                                            */
+/***************************************************************/
+static _Thread_local int CYCLE_COUNT;
+
+/***************************************************************/
+/* Instructions completed.                                     */
+/***************************************************************/
+static _Thread_local int INSTRUCTION_COUNT;
+
+/***************************************************************/
+/* Core number in system mode, -1 when running a single core.  */
+/***************************************************************/
+static _Thread_local int CORE_ID = -1;
+
+static _Thread_local int COUNT;
+
+/***************************************************************/
+/* Memory timing backends.                                     */
+/***************************************************************/
+#define MAX_BANKS  16
+#define MAX_POSTED 16
+
+/* ACCESS is called when an access starts and returns the number of cycles
+   it occupies, at least 2: READY is asserted in the next to last cycle
+   and the data moves in the last one. Times are in CYCLE_COUNT units. */
+/* What accesses change; snapshots keep only this. */
+typedef struct Backend_Timing_Struct {
+    int BANK_FREE[MAX_BANKS], OPEN_ROW[MAX_BANKS];
+    int POSTED[MAX_POSTED], POSTED_HEAD, POSTED_COUNT, PORT_FREE;
+} Backend_Timing;
+
+typedef struct Memory_Backend_Struct {
+    int (*ACCESS)(struct Memory_Backend_Struct *b, int word, int write);
+    char SPEC[64];		/* as selected, e.g. "banked:4:3:5:64:2" */
+
+    int LATENCY;		/* fixed, write buffer: cycles per access */
+    int BANKS, HIT, MISS, ROW_WORDS, BUSY;	/* banked */
+    int DEPTH, POST;		/* write buffer */
+
+    Backend_Timing TIMING;
+} Memory_Backend;
+
+static void backend_reset(Memory_Backend *b);
+static _Thread_local Memory_Backend *BACKEND;
+static _Thread_local int MEM_LATENCY;
+
+/***************************************************************/
+/* Switching activity counters.                                */
+/***************************************************************/
+typedef struct Activity_Struct {
+    unsigned long long COUNTS[LC3B_ACTIVITY_COUNTERS];
+    unsigned long long STATE_CYCLES[CONTROL_STORE_ROWS];
+    int LAST_BUS, LAST_READ;	/* values the bus and memory last carried */
+} Activity;
+
+static _Thread_local Activity *ACTIVITY;
+
+/***************************************************************/
+/* Live statistics, published to a shared page.                */
+/***************************************************************/
+typedef struct Live_Struct {
+    volatile Live_Page *PAGE;	/* NULL when not publishing */
+    int INTERVAL;		/* cycles between updates */
+    int NEXT;			/* CYCLE_COUNT of the next update */
+    unsigned long long READS, WRITES;
+    int LAST_CYCLE;		/* of the previous update */
+    double LAST_TIME;		/* seconds, monotonic */
+} Live;
+
+static _Thread_local Live *LIVE;
+static void live_begin();
+static void live_publish(int status);
+
+/***************************************************************/
+/* Fuzzing from a snapshot, see lc3b_fuzz_start.               */
+/***************************************************************/
+typedef struct Fuzz_Struct Fuzz;
+
+static _Thread_local Fuzz *FUZZ;
+static void fuzz_cycle();
+static void fuzz_retire();
+
+/***************************************************************/
+/* Microcode path fusion.                                      */
+/***************************************************************/
+#define MAX_CHAIN 16
+
+/* LENGTH[row] is the number of states, starting at row, that run as one
+   host step; 0 for rows that access memory. */
+typedef struct Fusion_Struct {
+    int LENGTH[CONTROL_STORE_ROWS];
+    unsigned long long STEPS, CYCLES;	/* fused steps taken, cycles they covered */
+} Fusion;
+
+static _Thread_local Fusion *FUSION;
+static void fusion_analyze(lc3b_machine *m);
+static int fused_step(int budget);
+
+/***************************************************************/
+/* A machine, as handed out by the API.                        */
+/***************************************************************/
+typedef struct Core_Context_Struct {
+    System_Latches LATCHES;
+    int BUS, RUN_BIT, CYCLE_COUNT, INSTRUCTION_COUNT, COUNT;
+    int COSIM_ACTIVE;
+    Retire_Record COSIM_RECORD;
+    int SNAPSHOT_INTERVAL, NEXT_SNAPSHOT;
+    FILE *TRACE_FILE;
+    int MEM_LATENCY;
+} Core_Context;
+
+struct lc3b_machine {
+    int MEMORY[WORDS_IN_MEM][2];
+    int CONTROL_STORE[CONTROL_STORE_ROWS][CONTROL_STORE_BITS];
+    int FETCH_STATE[CONTROL_STORE_ROWS];
+    Write_Tracker WRITTEN;
+
+    /* The thread-local core state, kept here between calls. */
+    Core_Context CONTEXT;
+
+    int COUNTING;		/* switching activity is being counted */
+    Activity COUNTERS;
+
+    Memory_Backend BACKEND;
+
+    Live LIVE;
+
+    Fuzz *FUZZ;			/* NULL when not fuzzing */
+
+    int FUSING;
+    Fusion FUSED;
+
+    int DIVERGED;		/* co-simulation stopped the machine */
+    char REPORT[1024];		/* the divergence */
+    char MESSAGE[256];		/* last error or warning */
+};
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : machine_enter                                   */
+/*                                                             */
+/* Purpose   : Make m the machine the calling thread simulates. */
+/*                                                             */
+/***************************************************************/
+static void machine_enter(lc3b_machine *m) {
+    Core_Context *c = &m->CONTEXT;
+
+    MEMORY = m->MEMORY;
+    CONTROL_STORE = m->CONTROL_STORE;
+    FETCH_STATE = m->FETCH_STATE;
+    WRITTEN = &m->WRITTEN;
+    ACTIVITY = m->COUNTING ? &m->COUNTERS : NULL;
+    BACKEND = &m->BACKEND;
+    LIVE = m->LIVE.PAGE ? &m->LIVE : NULL;
+    FUSION = m->FUSING ? &m->FUSED : NULL;
+
+    CURRENT_LATCHES = c->LATCHES;
+    NEXT_LATCHES = c->LATCHES;
+    BUS = c->BUS;
+    RUN_BIT = c->RUN_BIT;
+    CYCLE_COUNT = c->CYCLE_COUNT;
+    INSTRUCTION_COUNT = c->INSTRUCTION_COUNT;
+    COUNT = c->COUNT;
+    COSIM_ACTIVE = c->COSIM_ACTIVE;
+    COSIM_RECORD = c->COSIM_RECORD;
+    SNAPSHOT_INTERVAL = c->SNAPSHOT_INTERVAL;
+    NEXT_SNAPSHOT = c->NEXT_SNAPSHOT;
+    TRACE_FILE = c->TRACE_FILE;
+    MEM_LATENCY = c->MEM_LATENCY;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : machine_leave                                   */
+/*                                                             */
+/* Purpose   : Save the calling thread's core state back into m. */
+/*                                                             */
+/***************************************************************/
+static void machine_leave(lc3b_machine *m) {
+    Core_Context *c = &m->CONTEXT;
+
+    c->LATCHES = CURRENT_LATCHES;
+    c->BUS = BUS;
+    c->RUN_BIT = RUN_BIT;
+    c->CYCLE_COUNT = CYCLE_COUNT;
+    c->INSTRUCTION_COUNT = INSTRUCTION_COUNT;
+    c->COUNT = COUNT;
+    c->COSIM_ACTIVE = COSIM_ACTIVE;
+    c->COSIM_RECORD = COSIM_RECORD;
+    c->SNAPSHOT_INTERVAL = SNAPSHOT_INTERVAL;
+    c->NEXT_SNAPSHOT = NEXT_SNAPSHOT;
+    c->TRACE_FILE = TRACE_FILE;
+    c->MEM_LATENCY = MEM_LATENCY;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : cycle                                           */
+/*                                                             */
+/* Purpose   : Execute a cycle                                 */
+/*                                                             */
+/***************************************************************/
+static void cycle() {                                                
+
+  if (COSIM_ACTIVE) cosim_fetch();
+  if (TRACE_FILE) trace_cycle();
+
+  eval_micro_sequencer();   
+  cycle_memory();
+  eval_bus_drivers();
+  drive_bus();
+  latch_datapath_values();
+
+  if (ACTIVITY) activity_cycle();
+  if (FUZZ) fuzz_cycle();
+
+  /* Returning to the fetch state retires the current instruction. */
+  if (FETCH_STATE[NEXT_LATCHES.STATE_NUMBER]) {
+      INSTRUCTION_COUNT++;
+      if (COSIM_ACTIVE) cosim_retire();
+  }
+
+  CURRENT_LATCHES = NEXT_LATCHES;
+
+  CYCLE_COUNT++;
+
+  if (CYCLE_COUNT == NEXT_SNAPSHOT) snapshot_take();
+  if (LIVE && CYCLE_COUNT == LIVE->NEXT) live_publish(LIVE_RUNNING);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_step_cycles                                */
+/*                                                             */
+/* Purpose   : Simulate the LC-3b for n cycles.                */
+/*                                                             */
+/***************************************************************/
+int lc3b_step_cycles(lc3b_machine *m, int n) {
+    int i, k;
+
+    machine_enter(m);
+    if (LIVE) live_begin();
+    for (i = 0; i < n && RUN_BIT; i += k) {
+	if (CURRENT_LATCHES.PC == 0x0000) {
+	    RUN_BIT = FALSE;
+	    break;
+	}
+	if (!FUSION || (k = fused_step(n - i)) == 0) {
+	    cycle();
+	    k = 1;
+	}
+    }
+    if (COSIM_ACTIVE) cosim_sync(m);
+    if (LIVE) live_publish(m->DIVERGED ? LIVE_DIVERGED : LIVE_IDLE);
+    machine_leave(m);
+    return i;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_step_instructions                          */
+/*                                                             */
+/* Purpose   : Simulate the LC-3b until n instructions have    */
+/*             completed.                                      */
+/*                                                             */
+/***************************************************************/
+int lc3b_step_instructions(lc3b_machine *m, int n) {
+    int start;
+
+    machine_enter(m);
+    start = INSTRUCTION_COUNT;
+    if (LIVE) live_begin();
+    while (INSTRUCTION_COUNT - start < n && RUN_BIT) {
+	if (CURRENT_LATCHES.PC == 0x0000) {
+	    RUN_BIT = FALSE;
+	    break;
+	}
+	if (!FUSION || fused_step(MAX_CHAIN) == 0)
+	    cycle();
+    }
+    if (COSIM_ACTIVE) cosim_sync(m);
+    if (LIVE) live_publish(m->DIVERGED ? LIVE_DIVERGED : LIVE_IDLE);
+    machine_leave(m);
+    return INSTRUCTION_COUNT - start;
+}
+
+int lc3b_status(lc3b_machine *m) {
+    if (m->CONTEXT.RUN_BIT)
+	return LC3B_RUNNING;
+    return m->DIVERGED ? LC3B_DIVERGED : LC3B_HALTED;
+}
+
+int lc3b_cycles(lc3b_machine *m)       { return m->CONTEXT.CYCLE_COUNT; }
+int lc3b_instructions(lc3b_machine *m) { return m->CONTEXT.INSTRUCTION_COUNT; }
+const char *lc3b_message(lc3b_machine *m) { return m->MESSAGE; }
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_get_reg, lc3b_set_reg                      */
+/*                                                             */
+/* Purpose   : Read and write registers and latches.           */
+/*                                                             */
+/***************************************************************/
+int lc3b_get_reg(lc3b_machine *m, int reg) {
+    System_Latches *l = &m->CONTEXT.LATCHES;
+
+    switch (reg) {
+    case LC3B_PC:           return l->PC;
+    case LC3B_IR:           return l->IR;
+    case LC3B_MAR:          return l->MAR;
+    case LC3B_MDR:          return l->MDR;
+    case LC3B_N:            return l->N;
+    case LC3B_Z:            return l->Z;
+    case LC3B_P:            return l->P;
+    case LC3B_BEN:          return l->BEN;
+    case LC3B_STATE_NUMBER: return l->STATE_NUMBER;
+    case LC3B_BUS:          return m->CONTEXT.BUS;
+    default:
+	if (reg >= LC3B_R0 && reg <= LC3B_R7)
+	    return l->REGS[reg - LC3B_R0];
+	return 0;
+    }
+}
+
+void lc3b_set_reg(lc3b_machine *m, int reg, int value) {
+    System_Latches *l = &m->CONTEXT.LATCHES;
+
+    value = Low16bits(value);
+    switch (reg) {
+    case LC3B_PC:  l->PC = value; break;
+    case LC3B_IR:  l->IR = value; break;
+    case LC3B_MAR: l->MAR = value; break;
+    case LC3B_MDR: l->MDR = value; break;
+    case LC3B_N:   l->N = value & 1; break;
+    case LC3B_Z:   l->Z = value & 1; break;
+    case LC3B_P:   l->P = value & 1; break;
+    case LC3B_BEN: l->BEN = value & 1; break;
+    default:
+	if (reg >= LC3B_R0 && reg <= LC3B_R7)
+	    l->REGS[reg - LC3B_R0] = value;
+	break;
+    }
+    history_edit(m, -1);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_read_word, lc3b_write_word,                */
+/*             lc3b_read_byte, lc3b_write_byte                 */
+/*                                                             */
+/* Purpose   : Access memory by byte address.                  */
+/*                                                             */
+/***************************************************************/
+int lc3b_read_word(lc3b_machine *m, int address) {
+    int word = (address >> 1) & (WORDS_IN_MEM - 1);
+    return m->MEMORY[word][1] << 8 | m->MEMORY[word][0];
+}
+
+void lc3b_write_word(lc3b_machine *m, int address, int value) {
+    int word = (address >> 1) & (WORDS_IN_MEM - 1);
+    history_edit(m, word);
+    m->MEMORY[word][0] = value & 0xFF;
+    m->MEMORY[word][1] = (value >> 8) & 0xFF;
+    track_write(&m->WRITTEN, word);
+}
+
+int lc3b_read_byte(lc3b_machine *m, int address) {
+    return m->MEMORY[(address >> 1) & (WORDS_IN_MEM - 1)][address & 1];
+}
+
+void lc3b_write_byte(lc3b_machine *m, int address, int value) {
+    int word = (address >> 1) & (WORDS_IN_MEM - 1);
+    history_edit(m, word);
+    m->MEMORY[word][address & 1] = value & 0xFF;
+    track_write(&m->WRITTEN, word);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : dump_header                                     */
+/*                                                             */
+/* Purpose   : Write the header and latches of a binary dump   */
+/*             record.                                         */
+/*                                                             */
+/***************************************************************/
+static void dump_header(lc3b_machine *m, FILE * dump_file, int kind) {
+    unsigned char header[DUMP_HEADER_BYTES], *p = header + 12;
+    System_Latches *l = &m->CONTEXT.LATCHES;
+    int k;
+
+    memcpy(header, DUMP_MAGIC, 4);
+    dump_put16(header + 4, DUMP_VERSION);
+    dump_put16(header + 6, kind);
+    dump_put32(header + 8, m->CONTEXT.CYCLE_COUNT);
+
+    dump_put16(p + 2*DUMP_PC, l->PC);
+    dump_put16(p + 2*DUMP_IR, l->IR);
+    dump_put16(p + 2*DUMP_STATE_NUMBER, l->STATE_NUMBER);
+    dump_put16(p + 2*DUMP_BUS, m->CONTEXT.BUS);
+    dump_put16(p + 2*DUMP_MDR, l->MDR);
+    dump_put16(p + 2*DUMP_MAR, l->MAR);
+    dump_put16(p + 2*DUMP_N, l->N);
+    dump_put16(p + 2*DUMP_Z, l->Z);
+    dump_put16(p + 2*DUMP_P, l->P);
+    dump_put16(p + 2*DUMP_BEN, l->BEN);
+    for (k = 0; k < LC_3b_REGS; k++)
+	dump_put16(p + 2*(DUMP_R0 + k), l->REGS[k]);
+
+    fwrite(header, 1, sizeof(header), dump_file);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_dump_full                                  */
+/*                                                             */
+/* Purpose   : Append the latches and a word-aligned region    */
+/*             of memory to a binary dump file.                */
+/*                                                             */
+/***************************************************************/
+int lc3b_dump_full(lc3b_machine *m, FILE * dump_file, int start, int stop) {
+    static _Thread_local unsigned char words[2 * WORDS_IN_MEM];
+    unsigned char body[6];
+    int address, count;
+
+    start >>= 1;
+    stop >>= 1;
+    if (start < 0 || stop >= WORDS_IN_MEM || start > stop) {
+	snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Invalid memory range");
+	return LC3B_ERROR;
+    }
+
+    count = stop - start + 1;
+    for (address = start; address <= stop; address++)
+	dump_put16(words + 2*(address - start), m->MEMORY[address][1] << 8 | m->MEMORY[address][0]);
+
+    dump_header(m, dump_file, DUMP_FULL);
+    dump_put16(body, start);
+    dump_put32(body + 2, count);
+    fwrite(body, 1, sizeof(body), dump_file);
+    fwrite(words, 2, count, dump_file);
+    return count;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_dump_incremental                           */
+/*                                                             */
+/* Purpose   : Append the latches and every memory word        */
+/*             written since the previous incremental dump to  */
+/*             a binary dump file.                             */
+/*                                                             */
+/***************************************************************/
+int lc3b_dump_incremental(lc3b_machine *m, FILE * dump_file) {
+    static _Thread_local unsigned char entries[4 * WORDS_IN_MEM];
+    Write_Tracker *t = &m->WRITTEN;
+    unsigned char body[4];
+    int i, word, count = t->COUNT;
+
+    for (i = 0; i < count; i++) {
+	word = t->LIST[i];
+	dump_put16(entries + 4*i, word);
+	dump_put16(entries + 4*i + 2, m->MEMORY[word][1] << 8 | m->MEMORY[word][0]);
+	t->MAP[word >> 5] = 0;
+    }
+
+    dump_header(m, dump_file, DUMP_INCREMENTAL);
+    dump_put32(body, count);
+    fwrite(body, 1, sizeof(body), dump_file);
+    fwrite(entries, 4, count, dump_file);
+
+    t->COUNT = 0;
+    return count;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_load_ucode                                 */
+/*                                                             */
+/* Purpose   : Load microprogram into control store ROM        */ 
+/*                                                             */
+/***************************************************************/
+int lc3b_load_ucode(lc3b_machine *m, const char *text, size_t length) {
+    static _Thread_local int store[CONTROL_STORE_ROWS][CONTROL_STORE_BITS];
+    const char *p = text, *end = text + length;
+    int i, j;
+
+    m->MESSAGE[0] = '\0';
+
+    /* Read a line for each row in the control store. */
+    for(i = 0; i < CONTROL_STORE_ROWS; i++) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	    p++;
+	if (p == end) {
+	    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+		     "Too few lines (%d) in micro-code file", i);
+	    return LC3B_ERROR;
+	}
+
+	/* Put in bits one at a time. */
+	for (j = 0; j < CONTROL_STORE_BITS; j++, p++) {
+	    /* Needs to find enough bits in line. */
+	    if (p == end || *p == '\n') {
+		snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+			 "Too few control bits in micro-code file, line %d", i);
+		return LC3B_ERROR;
+	    }
+	    if (*p != '0' && *p != '1') {
+		snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+			 "Unknown value in micro-code file, line %d, bit %d", i, j);
+		return LC3B_ERROR;
+	    }
+
+	    /* Set the bit in the Control Store. */
+	    store[i][j] = (*p == '0') ? 0:1;
+	}
+
+	/* Warn about extra bits in line. */
+	if (p < end && *p != '\n' && m->MESSAGE[0] == '\0')
+	    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+		     "Extra bit(s) in control store file, line %d", i);
+	while (p < end && *p != '\n')
+	    p++;
+    }
+
+    /* Only a valid control store replaces the old one. Calls only return
+       between cycles, so this is always a microinstruction boundary.
+       Activity counted so far belongs to the old control store. */
+    activity_fold(m);
+    memcpy(m->CONTROL_STORE, store, sizeof(store));
+    for (i = 0; i < CONTROL_STORE_ROWS; i++)
+	m->FETCH_STATE[i] = memcmp(m->CONTROL_STORE[i], m->CONTROL_STORE[INITIAL_STATE_NUMBER],
+				   sizeof(int)*CONTROL_STORE_BITS) == 0;
+    fusion_analyze(m);
+
+    memcpy(m->CONTEXT.LATCHES.MICROINSTRUCTION, m->CONTROL_STORE[m->CONTEXT.LATCHES.STATE_NUMBER],
+	   sizeof(int)*CONTROL_STORE_BITS);
+
+    /* A memory access in progress ends if the new row doesn't continue it. */
+    if (!m->CONTROL_STORE[m->CONTEXT.LATCHES.STATE_NUMBER][MIO_EN])
+	m->CONTEXT.COUNT = 0;
+
+    /* Replaying from older snapshots would use the new control store. */
+    if (HISTORY_MACHINE == m) {
+	machine_enter(m);
+	snapshot_reset();
+	machine_leave(m);
+    }
+    return LC3B_OK;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : lc3b_load_program                              */
+/*                                                            */
+/* Purpose   : Load program and service routines into mem.    */
+/*                                                            */
+/**************************************************************/
+int lc3b_load_program(lc3b_machine *m, const char *text, size_t length) {
+    const char *p = text, *end = text + length;
+    char *next, word_text[16];
+    int ii, word, program_base = -1, n;
+
+    m->MESSAGE[0] = '\0';
+
+    /* Read in the program, one hex word at a time. */
+    for (ii = -1; ; ii++) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	    p++;
+	if (p == end)
+	    break;
+	for (n = 0; p < end && n < (int) sizeof(word_text) - 1 && *p != '\n' && *p != ' '
+		 && *p != '\t' && *p != '\r'; n++)
+	    word_text[n] = *p++;
+	word_text[n] = '\0';
+	word = (int) strtol(word_text, &next, 16);
+	if (next == word_text) {
+	    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Bad word in program: %s", word_text);
+	    return LC3B_ERROR;
+	}
+
+	if (ii < 0) {
+	    program_base = word >> 1;
+	    continue;
+	}
+
+	/* Make sure it fits. */
+	if (program_base + ii >= WORDS_IN_MEM) {
+	    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+		     "Program is too long to fit in memory. %x", ii);
+	    return LC3B_ERROR;
+	}
+
+	/* Write the word to memory array. */
+	m->MEMORY[program_base + ii][0] = word & 0x00FF;
+	m->MEMORY[program_base + ii][1] = (word >> 8) & 0x00FF;
+	track_write(&m->WRITTEN, program_base + ii);
+    }
+
+    if (program_base < 0) {
+	snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Program file is empty");
+	return LC3B_ERROR;
+    }
+
+    if (m->CONTEXT.LATCHES.PC == 0) m->CONTEXT.LATCHES.PC = (program_base << 1);
+
+    /* Going back would keep the new program. */
+    if (HISTORY_MACHINE == m) {
+	machine_enter(m);
+	snapshot_reset();
+	machine_leave(m);
+    }
+    return ii;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_reset                                      */
+/*                                                             */
+/* Purpose   : Zero out memory and set up the initial state of */
+/*             the machine.                                    */
+/*                                                             */
+/***************************************************************/
+void lc3b_reset(lc3b_machine *m) {
+    Core_Context *c = &m->CONTEXT;
+
+    if (c->COSIM_ACTIVE) {
+	machine_enter(m);
+	cosim_stop(m);
+	machine_leave(m);
+    }
+
+    memset(m->MEMORY, 0, sizeof(m->MEMORY));
+    memset(&m->WRITTEN, 0, sizeof(m->WRITTEN));
+
+    memset(&c->LATCHES, 0, sizeof(c->LATCHES));
+    c->LATCHES.Z = 1;
+    c->LATCHES.STATE_NUMBER = INITIAL_STATE_NUMBER;
+    memcpy(c->LATCHES.MICROINSTRUCTION, m->CONTROL_STORE[INITIAL_STATE_NUMBER], sizeof(int)*CONTROL_STORE_BITS);
+    c->BUS = 0;
+    c->RUN_BIT = TRUE;
+    c->CYCLE_COUNT = 0;
+    c->INSTRUCTION_COUNT = 0;
+    c->COUNT = 0;
+    c->MEM_LATENCY = MEM_CYCLES;
+    backend_reset(&m->BACKEND);
+    m->DIVERGED = FALSE;
+    m->REPORT[0] = '\0';
+
+    if (HISTORY_MACHINE == m) {
+	machine_enter(m);
+	snapshot_reset();
+	machine_leave(m);
+    }
+}
+
+lc3b_machine *lc3b_create(void) {
+    static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+    lc3b_machine *m = calloc(1, sizeof(lc3b_machine));
+
+    pthread_once(&decode_once, decode_init);
+    if (m == NULL)
+	return NULL;
+    m->CONTEXT.NEXT_SNAPSHOT = -1;
+    m->FUSING = TRUE;
+    lc3b_set_memory(m, NULL);
+    lc3b_reset(m);
+    return m;
+}
+
+void lc3b_destroy(lc3b_machine *m) {
+    if (m == NULL)
+	return;
+    lc3b_cosim_stop(m);
+    if (HISTORY_MACHINE == m)
+	lc3b_history(m, 0, 0);
+    lc3b_live_stop(m);
+    lc3b_fuzz_stop(m);
+    free(m);
+}
+
+/***************************************************************/
+/* The datapath. The code below evaluates one clock cycle of   */
+/* the microarchitecture through these globals, set up by the  */
+/* machine management code above:                              */
+/*                                                             */
+/*   CONTROL_STORE                                             */
+/*   MEMORY                                                    */
+/*   BUS                                                       */
+/*                                                             */
+/*   CURRENT_LATCHES                                           */
+/*   NEXT_LATCHES                                              */
+/***************************************************************/
+
+//         Xiaofei's Implementation starts from here
+
+//////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////
+///////////////////////// Variables //////////////////////////////
+
+static _Thread_local int *x;
+
+static _Thread_local int COUNT=0;
+
+static _Thread_local int vALU, vMAR, vMDR, vSHF, vPC;
+
+// Every field the datapath takes from IR below the opcode, decoded once
+// for each of the 4096 values of IR[11:0], so the routines below index
+// DECODED(IR) instead of extracting and sign-extending bits every cycle.
+// The opcode is just IR[15:12]. Offsets are already sign-extended;
+// TRAP_ADDR is trapvect8 zero-extended and shifted left. 18 bytes an
+// entry keeps the whole table in 72 KB.
+typedef struct Decoded_IR_Struct {
+  short OFFSET9, OFFSET11, TRAP_ADDR;
+  signed char IMM5, OFFSET6;
+  unsigned char DR, SR1, SR2;
+  unsigned char IR_11, IR_5;           // JSR/JSRR select and N, register/immediate
+  unsigned char Z, P;                  // the other branch condition bits
+  unsigned char AMOUNT4, SHF_CONTROL;  // shift amount, IR[5:4]
+} Decoded_IR;
+
+static Decoded_IR DECODE[1 << 12];
+
+#define OPCODE_OF(ir) (((ir) >> 12) & 0xF)
+#define DECODED(ir)   (&DECODE[(ir) & 0xFFF])
+
+// defined below, after the routines that call them
+static int MEM_READ(), MEM_WRITE(), GETBEN();
+static int GET_ALU_RESULT(), GET_PC_RESULT(), GET_MAR_RESULT(), GET_SHF_RESULT();
+static int GET_ADDRESS_ADDER();
+
+
+//////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////
+//////////////// Addition Functions //////////////////////////////
+
+static int Get_Bits(int value, int start, int end){
+  int result;
+  result = value >> end;
+  result = result % ( 1 << ( start - end + 1 ) );
+  return result; 
+}
+
+static int SEXT(int value, int topbit){
+  int shift = sizeof(int)*8 - topbit; 
+  return (value << shift )>> shift;
+}
+
+static int ZEXT(int value){
+return value & 0xFFFF;
+}
+
+static int LSHF(int value, int amount){
+  return (value << amount) & 0xFFFF;
+}
+
+static int RSHF(int value, int amount, int topbit ){
+  int mask;
+  mask = 1 << amount;
+  mask -= 1;
+  mask = mask << ( 16 -amount );
+  
+  return ((value >> amount) & ~mask) | ((topbit)?(mask):0); /* TBD */
+}
+
+static void decode_init(){
+  int ir;
+  Decoded_IR *d;
+
+  for(ir = 0; ir < (1 << 12); ir++)
+  {
+    d = &DECODE[ir];
+    d->DR = Get_Bits(ir,11,9);
+    d->SR1 = Get_Bits(ir,8,6);       // also BaseR
+    d->SR2 = Get_Bits(ir,2,0);
+    d->IR_11 = Get_Bits(ir,11,11);
+    d->IR_5 = Get_Bits(ir,5,5);
+    d->Z = Get_Bits(ir,10,10);
+    d->P = Get_Bits(ir,9,9);
+    d->AMOUNT4 = Get_Bits(ir,3,0);
+    d->SHF_CONTROL = Get_Bits(ir,5,4);
+    d->IMM5 = SEXT(Get_Bits(ir,4,0),5);
+    d->OFFSET6 = SEXT(Get_Bits(ir,5,0),6);
+    d->OFFSET9 = SEXT(Get_Bits(ir,8,0),9);
+    d->OFFSET11 = SEXT(Get_Bits(ir,10,0),11);
+    d->TRAP_ADDR = LSHF(ZEXT(Get_Bits(ir,7,0)),1);
+  }
+}
+
+/////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////
+
+static void eval_micro_sequencer() {
+
+   x = CURRENT_LATCHES.MICROINSTRUCTION;
+
+   const Decoded_IR *d = DECODED(CURRENT_LATCHES.IR);
+
+   int OPCODE = OPCODE_OF(CURRENT_LATCHES.IR);
+   
+
+   int IR_11 = d->IR_11;
+
+   int J_BITS;
+
+   
+   int COND = GetCOND(x);
+   
+   
+   
+   switch(COND)
+   {
+     case 0:
+       J_BITS = GetJ(x);
+       break;
+     case 1:
+       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (x[J2]<<2) + (CURRENT_LATCHES.READY<<1) + x[J0];
+       break;
+     case 2:
+       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (CURRENT_LATCHES.BEN<<2) + (x[J1]<<1) + x[J0];
+       break;
+     case 3:
+       J_BITS = (x[J5]<<5) + (x[J4]<<4) + (x[J3]<<3) + (x[J2]<<2) + (x[J1]<<1) + IR_11;
+       break;
+       
+     default: break;
+   }
+
+
+   int MUX[2];
+   MUX[0] = J_BITS;
+   MUX[1] = OPCODE;
+
+   int ROW = MUX[GetIRD(x)]; 
+   
+   
+   NEXT_LATCHES.STATE_NUMBER = ROW;
+   
+   int i=0;
+   for(i=0;i<35;i++)
+   {
+     NEXT_LATCHES.MICROINSTRUCTION[i] = CONTROL_STORE[ROW][i];
+   }
+   
+}
+
+
+static void cycle_memory() 
+{   
+    NEXT_LATCHES.READY = 0;
+    if(GetMIO_EN(x) == 1)
+    {
+	  // In system mode a new access first has to win the shared bus
+	  if (CORE_ID >= 0 && COUNT == 0 && !bus_acquire())
+	      return;
+
+	  // The memory backend decides how long an access takes as it starts
+	  if (COUNT == 0) {
+	      MEM_LATENCY = BACKEND ? BACKEND->ACCESS(BACKEND, CURRENT_LATCHES.MAR >> 1, GetR_W(x))
+				    : MEM_CYCLES;
+	      if (LIVE) {
+		  if (GetR_W(x)) LIVE->WRITES++;
+		  else LIVE->READS++;
+	      }
+	  }
+
+	  // Write
+	  if (GetR_W(x)== 1 )
+	  {
+	      COUNT += 1;
+	      if ( COUNT == MEM_LATENCY - 1 )
+	      {
+		  NEXT_LATCHES.READY = 1;   
+	      }
+	      else if( COUNT == MEM_LATENCY)
+	      {
+		  if (CORE_ID >= 0) system_lock();
+		  MEM_WRITE();
+		  if (CORE_ID >= 0) system_unlock();
+		  COUNT = 0;
+	      }
+
+	  }
+	  
+	  //READ
+	  if(GetR_W(x) == 0 )
+	  {
+	      COUNT += 1;
+	      if ( COUNT == MEM_LATENCY - 1 )
+	      {
+		  NEXT_LATCHES.READY = 1;   
+
+	      }
+	      else if( COUNT == MEM_LATENCY)
+	      {
+		if (CORE_ID >= 0) system_lock();
+		NEXT_LATCHES.MDR = MEM_READ();
+		if (CORE_ID >= 0) system_unlock();
+		if (ACTIVITY) activity_read(NEXT_LATCHES.MDR);
+		COUNT = 0;
+	      }
+
+	  }
+    }
+}
+
+
+static void eval_bus_drivers() {
+
+    vALU = GET_ALU_RESULT();
+    
+
+    vPC = CURRENT_LATCHES.PC;
+    
+
+    vSHF = GET_SHF_RESULT();
+    
+    vMDR = CURRENT_LATCHES.MDR;
+
+  
+    vMAR = GET_MAR_RESULT();
+  
+}
+
+
+static void drive_bus() {
+
+    int ALU_BOX[2] = {0,vALU};
+    int PC_BOX[2]  = {0,vPC};
+    int SHF_BOX[2] = {0,vSHF};
+    int MDR_BOX[2] = {0,vMDR};
+    int MAR_BOX[2] = {0,vMAR};
+
+    BUS = ALU_BOX[GetGATE_ALU(x)] + 
+          PC_BOX[GetGATE_PC(x)]   + 
+          SHF_BOX[GetGATE_SHF(x)] + 
+          MDR_BOX[GetGATE_MDR(x)] +
+          MAR_BOX[GetGATE_MARMUX(x)];
+	  
+	//  printf("bus%d,\n",BUS);
+}
+
+
+static void latch_datapath_values() {
+
+    //MAR    
+    int BUS_MAR[2] = { CURRENT_LATCHES.MAR, BUS };
+    NEXT_LATCHES.MAR = BUS_MAR[GetLD_MAR(x)];
+
+    //PC
+    int BUS_PC[2] = { CURRENT_LATCHES.PC, GET_PC_RESULT() };
+    NEXT_LATCHES.PC = BUS_PC[GetLD_PC(x)];
+
+  
+    //IR
+    int BUS_IR[2] = { CURRENT_LATCHES.IR, BUS};
+    NEXT_LATCHES.IR = BUS_IR[GetLD_IR(x)];
+
+
+  if(GetLD_CC(x)){
+   NEXT_LATCHES.N=0;
+  NEXT_LATCHES.Z=0;
+  NEXT_LATCHES.P=0;
+  if ( BUS == 0 )      NEXT_LATCHES.Z=1;
+  else if ( BUS & 0x8000 )  NEXT_LATCHES.N=1;
+  else                   NEXT_LATCHES.P=1;
+  }
+    //BEN
+    if(GetLD_BEN(x))
+    {
+      NEXT_LATCHES.BEN = GETBEN();
+    }
+    
+    //MDR
+    if(GetMIO_EN(x) == 0)
+    {
+      	  int MDR_MUX[2];
+	  MDR_MUX[0] = CURRENT_LATCHES.MDR;
+	  MDR_MUX[1] = BUS;
+	  NEXT_LATCHES.MDR = MDR_MUX[GetLD_MDR(x)];
+    }
+
+    //REG
+    if(GetLD_REG(x))
+    {
+        int DR_MUX[2];
+
+        DR_MUX[0] = DECODED(CURRENT_LATCHES.IR)->DR;
+        DR_MUX[1] = 7;
+
+        int DR_ADDR = DR_MUX[GetDRMUX(x)];
+        NEXT_LATCHES.REGS[DR_ADDR] = BUS;
+
+        if (COSIM_ACTIVE)
+        {
+          COSIM_RECORD.DR = DR_ADDR;
+          COSIM_RECORD.DR_VALUE = BUS;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Routines ///////////////////////////////////
+
+static int GET_ALU_RESULT()
+{
+   int ALU_MUX[4];
+    
+   int SR1_MUX[2];
+
+   const Decoded_IR *d = DECODED(CURRENT_LATCHES.IR);
+
+   SR1_MUX[0] = d->DR;
+   SR1_MUX[1] = d->SR1;
+   int SR1_ADDR = SR1_MUX[GetSR1MUX(x)];
+
+   int SR2MUX[2];
+   int IR_5 = d->IR_5;
+   SR2MUX[0] = CURRENT_LATCHES.REGS[d->SR2];
+   SR2MUX[1] = d->IMM5;
+
+   int A = CURRENT_LATCHES.REGS[SR1_ADDR];
+   int B = SR2MUX[IR_5];
+
+    ALU_MUX[0] = A + B;
+    ALU_MUX[1] = A & B;
+    ALU_MUX[2] = A ^ B;
+    ALU_MUX[3] = A;
+
+    return Low16bits(ALU_MUX[GetALUK(x)]);
+}
+
+static int GET_PC_RESULT()
+{
+    int MUX[3];
+
+    MUX[0] = CURRENT_LATCHES.PC + 2;
+    MUX[1] = BUS;
+    MUX[2] = GET_ADDRESS_ADDER();
+
+    return Low16bits(MUX[GetPCMUX(x)]);
+
+}
+
+static int GET_MAR_RESULT()
+{
+    int MUX[2];
+
+    MUX[0] = DECODED(CURRENT_LATCHES.IR)->TRAP_ADDR;
+    
+    MUX[1] = GET_ADDRESS_ADDER();
+
+    return  Low16bits(MUX[GetMARMUX(x)]);
+
+}
+
+static int GET_SHF_RESULT()
+{
+    const Decoded_IR *d = DECODED(CURRENT_LATCHES.IR);
+    int amount4 = d->AMOUNT4;
+    int SR = CURRENT_LATCHES.REGS[d->SR1];
+    int SR_topbit = SR>>15;
+    int SHF_CONTROL = d->SHF_CONTROL;
+
+    int MUX[4];
+
+    MUX[0] = LSHF(SR,amount4);              // SHFL
+    MUX[1] = RSHF(SR,amount4,0);            // RSHFL
+    MUX[2] = 0;                             // No this condition
+    MUX[3] = RSHF(SR,amount4,SR_topbit);    // RSHFA
+
+    return Low16bits(MUX[SHF_CONTROL]);
+
+}
+
+
+static int GET_ADDRESS_ADDER()
+{
+    int ADDR_ADDER_IN_1;
+    int ADDR_ADDER_IN_2;
+
+    // IN_1
+    int R1_MUX[2];
+
+    const Decoded_IR *d = DECODED(CURRENT_LATCHES.IR);
+    int BaseR = CURRENT_LATCHES.REGS[d->SR1];
+
+    R1_MUX[0] = CURRENT_LATCHES.PC;
+    R1_MUX[1] = BaseR;
+
+    // IN_2
+    int R2_MUX[4];
+
+    int ZERO = 0;
+    int offset6 = d->OFFSET6;
+    int offset9 = d->OFFSET9;
+    int offset11 = d->OFFSET11;
+
+    R2_MUX[0] = ZERO;
+    R2_MUX[1] = offset6;
+    R2_MUX[2] = offset9;
+    R2_MUX[3] = offset11;
+
+    int LSHF1 = LSHF(R2_MUX[GetADDR2MUX(x)],GetLSHF1(x));
+    
+    ADDR_ADDER_IN_1 = LSHF1;
+    ADDR_ADDER_IN_2 = R1_MUX[GetADDR1MUX(x)];
+
+    return Low16bits(ADDR_ADDER_IN_1 + ADDR_ADDER_IN_2);
+}
+
+static int GETBEN()
+{
+    const Decoded_IR *d = DECODED(CURRENT_LATCHES.IR);
+
+    int BEN1 = (d->IR_11 & CURRENT_LATCHES.N)+
+              (d->Z & CURRENT_LATCHES.Z)+
+              (d->P & CURRENT_LATCHES.P);
+    return BEN1;
+}
+
+static int MEM_READ()
+{
+  int addr = CURRENT_LATCHES.MAR;
+  int bank=addr&1;
+  
+  if(GetDATA_SIZE(x)==1)
+  {
+    return MEMORY[addr>>1][1]<<8 | MEMORY[addr>>1][0];
+  }
+  if(GetDATA_SIZE(x)==0)
+  {
+    return Low16bits(SEXT(MEMORY[addr>>1][bank],8));
+  }
+}
+
+static int MEM_WRITE()
+{
+  int addr = CURRENT_LATCHES.MAR;
+  int bank=addr&1;
+  
+  if (SNAPSHOT_INTERVAL) undo_record(addr>>1);
+  if (ACTIVITY) activity_write(addr>>1);
+
+  if (COSIM_ACTIVE)
+  {
+    COSIM_RECORD.MEM_SIZE = GetDATA_SIZE(x) + 1;
+    COSIM_RECORD.MEM_ADDR = GetDATA_SIZE(x) ? (addr & ~1) : addr;
+    COSIM_RECORD.MEM_VALUE = GetDATA_SIZE(x) ? Low16bits(CURRENT_LATCHES.MDR) : (CURRENT_LATCHES.MDR & 0xFF);
+  }
+
+  if(GetDATA_SIZE(x)==0)
+  {
+    MEMORY[addr>>1][bank]= CURRENT_LATCHES.MDR & 0xFF;
+  }
+  
+  if(GetDATA_SIZE(x)==1)
+  {
+    MEMORY[addr>>1][1] = (CURRENT_LATCHES.MDR & 0x0000FF00) >> 8;
+    MEMORY[addr>>1][0] = CURRENT_LATCHES.MDR & 0xFF;
+  }
+
+  mark_written(addr>>1);
+  return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Co-simulation ////////////////////////////////////
+
+/* The reference model is a plain ISA-level LC-3b interpreter with its own
+   copy of memory. It runs on its own thread and consumes the retire records
+   the datapath produces through a single-producer/single-consumer ring, so
+   the simulator only pays for filling in a record per instruction.
+
+   Opcodes 1000, 1010 and 1011 fall through to the fetch state in the shipped
+   microcode, so the reference model treats them as no-ops as well. */
+
+#define COSIM_QUEUE_SIZE 4096	/* must be a power of two */
+#define COSIM_BATCH 64		/* records queued before a waiting model is woken */
+
+#define COSIM_OFF     0
+#define COSIM_PENDING 1		/* waiting for an instruction boundary */
+#define COSIM_RUNNING 2
+#define COSIM_INLINE  3		/* checked on the simulator's thread, for fuzzing */
+
+typedef struct Ref_Model_Struct {
+  int PC, N, Z, P;
+  int REGS[LC_3b_REGS];
+  int MEMORY[WORDS_IN_MEM][2];
+  int INSTRUCTIONS;
+} Ref_Model;
+
+static _Thread_local int COSIM_ACTIVE = COSIM_OFF;
+static _Thread_local Retire_Record COSIM_RECORD;
+
+static Retire_Record COSIM_QUEUE[COSIM_QUEUE_SIZE];
+static _Alignas(64) atomic_uint COSIM_HEAD;	/* written by the simulator */
+static _Alignas(64) atomic_uint COSIM_TAIL;	/* written by the reference model */
+static _Alignas(64) atomic_int COSIM_DIVERGED;
+static atomic_int COSIM_QUIT;
+
+/* Either side that runs out of work sleeps on a condition variable after
+   raising its WAITING flag; the other side only takes the lock when it
+   sees the flag. */
+static pthread_mutex_t COSIM_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t COSIM_WORK = PTHREAD_COND_INITIALIZER;	/* records queued, or quit */
+static pthread_cond_t COSIM_ROOM = PTHREAD_COND_INITIALIZER;	/* records checked */
+static atomic_int COSIM_MODEL_WAITING;
+static atomic_int COSIM_SIM_WAITING;
+
+static pthread_t COSIM_THREAD;
+static Ref_Model *REF;
+static char COSIM_REPORT[1024];
+static int COSIM_REPORT_CYCLE;		/* the diverging record's cycle */
+static lc3b_machine *COSIM_MACHINE;	/* the machine being checked */
+
+
+static void cosim_clear_record()
+{
+  COSIM_RECORD.DR = -1;
+  COSIM_RECORD.MEM_SIZE = 0;
+}
+
+/* Execute one instruction on the reference model and describe what it did
+   in the same form the datapath reports it. */
+static void ref_execute(Ref_Model *m, Retire_Record *e)
+{
+  int ir = Low16bits(m->MEMORY[m->PC >> 1][1] << 8 | m->MEMORY[m->PC >> 1][0]);
+  int opcode = (ir >> 12) & 0xF;
+  int dr = (ir >> 9) & 7;
+  int sr1 = (ir >> 6) & 7;
+  int a = m->REGS[sr1];
+  int b = (ir & 0x20) ? Low16bits(SEXT(ir & 0x1F, 5)) : m->REGS[ir & 7];
+  int off6 = SEXT(ir & 0x3F, 6);
+  int addr, amount, setcc = FALSE;
+
+  e->PC = m->PC;
+  e->IR = ir;
+  e->DR = -1;
+  e->MEM_SIZE = 0;
+  m->PC = Low16bits(m->PC + 2);
+
+  switch (opcode)
+  {
+    case 0x1: /* ADD */
+    case 0x5: /* AND */
+    case 0x9: /* XOR */
+      e->DR = dr;
+      e->DR_VALUE = Low16bits(opcode == 0x1 ? a + b : opcode == 0x5 ? a & b : a ^ b);
+      setcc = TRUE;
+      break;
+
+    case 0x0: /* BR */
+      if ((((ir >> 11) & 1) & m->N) | (((ir >> 10) & 1) & m->Z) | (((ir >> 9) & 1) & m->P))
+        m->PC = Low16bits(m->PC + (SEXT(ir & 0x1FF, 9) << 1));
+      break;
+
+    case 0xC: /* JMP */
+      m->PC = a;
+      break;
+
+    case 0x4: /* JSR, JSRR */
+      e->DR = 7;
+      e->DR_VALUE = m->PC;
+      m->PC = (ir & 0x800) ? Low16bits(m->PC + (SEXT(ir & 0x7FF, 11) << 1)) : a;
+      break;
+
+    case 0x2: /* LDB */
+      addr = Low16bits(a + off6);
+      e->DR = dr;
+      e->DR_VALUE = Low16bits(SEXT(m->MEMORY[addr >> 1][addr & 1], 8));
+      setcc = TRUE;
+      break;
+
+    case 0x6: /* LDW */
+      addr = Low16bits(a + (off6 << 1));
+      e->DR = dr;
+      e->DR_VALUE = m->MEMORY[addr >> 1][1] << 8 | m->MEMORY[addr >> 1][0];
+      setcc = TRUE;
+      break;
+
+    case 0xE: /* LEA */
+      e->DR = dr;
+      e->DR_VALUE = Low16bits(m->PC + (SEXT(ir & 0x1FF, 9) << 1));
+      break;
+
+    case 0xD: /* SHF */
+      amount = ir & 0xF;
+      e->DR = dr;
+      if ((ir & 0x10) == 0)
+        e->DR_VALUE = LSHF(a, amount);
+      else
+        e->DR_VALUE = RSHF(a, amount, (ir & 0x20) ? a >> 15 : 0);
+      e->DR_VALUE = Low16bits(e->DR_VALUE);
+      setcc = TRUE;
+      break;
+
+    case 0x3: /* STB */
+      addr = Low16bits(a + off6);
+      e->MEM_SIZE = 1;
+      e->MEM_ADDR = addr;
+      e->MEM_VALUE = m->REGS[dr] & 0xFF;
+      m->MEMORY[addr >> 1][addr & 1] = e->MEM_VALUE;
+      break;
+
+    case 0x7: /* STW */
+      addr = Low16bits(a + (off6 << 1)) & ~1;
+      e->MEM_SIZE = 2;
+      e->MEM_ADDR = addr;
+      e->MEM_VALUE = m->REGS[dr];
+      m->MEMORY[addr >> 1][1] = (e->MEM_VALUE >> 8) & 0xFF;
+      m->MEMORY[addr >> 1][0] = e->MEM_VALUE & 0xFF;
+      break;
+
+    case 0xF: /* TRAP */
+      addr = (ir & 0xFF) << 1;
+      e->DR = 7;
+      e->DR_VALUE = m->PC;
+      m->PC = m->MEMORY[addr >> 1][1] << 8 | m->MEMORY[addr >> 1][0];
+      break;
+
+    default:  /* unused opcodes */
+      break;
+  }
+
+  if (e->DR >= 0)
+    m->REGS[e->DR] = e->DR_VALUE;
+
+  if (setcc)
+  {
+    m->N = (e->DR_VALUE & 0x8000) ? 1 : 0;
+    m->Z = (e->DR_VALUE == 0) ? 1 : 0;
+    m->P = (m->N == 0 && m->Z == 0) ? 1 : 0;
+  }
+
+  e->N = m->N;
+  e->Z = m->Z;
+  e->P = m->P;
+  e->NEXT_PC = m->PC;
+  m->INSTRUCTIONS++;
+}
+
+/* Compare the datapath's record with the reference model's. Returns the
+   length of the report written to buf, 0 if the records agree. */
+static int cosim_compare(Retire_Record *got, Retire_Record *exp, int count, char *buf, int size)
+{
+  int n = 0;
+
+  if (got->PC != exp->PC)
+    n += snprintf(buf + n, size - n, "  PC       : 0x%04x, expected 0x%04x\n", got->PC, exp->PC);
+  if (got->IR != exp->IR)
+    n += snprintf(buf + n, size - n, "  IR       : 0x%04x, expected 0x%04x\n", got->IR, exp->IR);
+  if (got->DR != exp->DR || (got->DR >= 0 && got->DR_VALUE != exp->DR_VALUE))
+    n += snprintf(buf + n, size - n, "  DR       : R%d = 0x%04x, expected R%d = 0x%04x\n",
+                  got->DR, got->DR >= 0 ? got->DR_VALUE : 0, exp->DR, exp->DR >= 0 ? exp->DR_VALUE : 0);
+  if (got->N != exp->N || got->Z != exp->Z || got->P != exp->P)
+    n += snprintf(buf + n, size - n, "  CCs      : N = %d  Z = %d  P = %d, expected N = %d  Z = %d  P = %d\n",
+                  got->N, got->Z, got->P, exp->N, exp->Z, exp->P);
+  if (got->MEM_SIZE != exp->MEM_SIZE ||
+      (got->MEM_SIZE && (got->MEM_ADDR != exp->MEM_ADDR || got->MEM_VALUE != exp->MEM_VALUE)))
+    n += snprintf(buf + n, size - n, "  Store    : size %d M[0x%04x] = 0x%04x, expected size %d M[0x%04x] = 0x%04x\n",
+                  got->MEM_SIZE, got->MEM_SIZE ? got->MEM_ADDR : 0, got->MEM_SIZE ? got->MEM_VALUE : 0,
+                  exp->MEM_SIZE, exp->MEM_SIZE ? exp->MEM_ADDR : 0, exp->MEM_SIZE ? exp->MEM_VALUE : 0);
+  if (got->NEXT_PC != exp->NEXT_PC)
+    n += snprintf(buf + n, size - n, "  Next PC  : 0x%04x, expected 0x%04x\n", got->NEXT_PC, exp->NEXT_PC);
+
+  if (n == 0)
+    return 0;
+
+  char head[160];
+  int h = snprintf(head, sizeof(head),
+                   "Co-simulation divergence at instruction %d (cycle %d), PC 0x%04x IR 0x%04x:\n",
+                   count, got->CYCLE, got->PC, got->IR);
+  if (h + n >= size) n = size - h - 1;
+  memmove(buf + h, buf, n);
+  memcpy(buf, head, h);
+  buf[h + n] = '\0';
+  return h + n;
+}
+
+static void cosim_wake(pthread_cond_t *cond)
+{
+  pthread_mutex_lock(&COSIM_LOCK);
+  pthread_cond_signal(cond);
+  pthread_mutex_unlock(&COSIM_LOCK);
+}
+
+/* Block the reference model until the queue holds more than the records
+   it has checked, or it is told to quit. */
+static void cosim_model_wait(unsigned tail)
+{
+  pthread_mutex_lock(&COSIM_LOCK);
+  atomic_store(&COSIM_MODEL_WAITING, TRUE);
+  while (atomic_load(&COSIM_HEAD) == tail && !atomic_load(&COSIM_QUIT))
+    pthread_cond_wait(&COSIM_WORK, &COSIM_LOCK);
+  atomic_store(&COSIM_MODEL_WAITING, FALSE);
+  pthread_mutex_unlock(&COSIM_LOCK);
+}
+
+/* Block the simulator until no more than left of the records up to head
+   are unchecked, or the model has diverged. */
+static void cosim_sim_wait(unsigned head, unsigned left)
+{
+  pthread_mutex_lock(&COSIM_LOCK);
+  atomic_store(&COSIM_SIM_WAITING, TRUE);
+  pthread_cond_signal(&COSIM_WORK);
+  while (head - atomic_load(&COSIM_TAIL) > left && !atomic_load(&COSIM_DIVERGED))
+    pthread_cond_wait(&COSIM_ROOM, &COSIM_LOCK);
+  atomic_store(&COSIM_SIM_WAITING, FALSE);
+  pthread_mutex_unlock(&COSIM_LOCK);
+}
+
+static void *cosim_thread(void *arg)
+{
+  Ref_Model *m = (Ref_Model *) arg;
+  Retire_Record exp;
+  unsigned tail = atomic_load_explicit(&COSIM_TAIL, memory_order_relaxed);
+
+  while (1)
+  {
+    unsigned head = atomic_load_explicit(&COSIM_HEAD, memory_order_acquire);
+
+    if (head == tail)
+    {
+      if (atomic_load_explicit(&COSIM_QUIT, memory_order_acquire) &&
+          head == atomic_load_explicit(&COSIM_HEAD, memory_order_acquire))
+        break;
+      cosim_model_wait(tail);
+      continue;
+    }
+
+    while (tail != head)
+    {
+      Retire_Record *got = &COSIM_QUEUE[tail & (COSIM_QUEUE_SIZE - 1)];
+      ref_execute(m, &exp);
+      if (cosim_compare(got, &exp, m->INSTRUCTIONS, COSIM_REPORT, sizeof(COSIM_REPORT)))
+      {
+        COSIM_REPORT_CYCLE = got->CYCLE;
+        atomic_store(&COSIM_DIVERGED, TRUE);
+        atomic_store(&COSIM_TAIL, head);
+        if (atomic_load(&COSIM_SIM_WAITING))
+          cosim_wake(&COSIM_ROOM);
+        return NULL;
+      }
+      tail++;
+    }
+    atomic_store(&COSIM_TAIL, tail);
+    if (atomic_load(&COSIM_SIM_WAITING))
+      cosim_wake(&COSIM_ROOM);
+  }
+  return NULL;
+}
+
+/* Take the reference model's initial state from the given latches; only
+   valid at an instruction boundary. */
+static void cosim_begin(System_Latches *latches)
+{
+  memcpy(REF->MEMORY, MEMORY, sizeof(REF->MEMORY));
+  memcpy(REF->REGS, latches->REGS, sizeof(REF->REGS));
+  REF->PC = latches->PC;
+  REF->N = latches->N;
+  REF->Z = latches->Z;
+  REF->P = latches->P;
+  REF->INSTRUCTIONS = 0;
+
+  atomic_store(&COSIM_HEAD, 0);
+  atomic_store(&COSIM_TAIL, 0);
+  atomic_store(&COSIM_DIVERGED, FALSE);
+  atomic_store(&COSIM_QUIT, FALSE);
+  atomic_store(&COSIM_MODEL_WAITING, FALSE);
+  atomic_store(&COSIM_SIM_WAITING, FALSE);
+  cosim_clear_record();
+
+  if (pthread_create(&COSIM_THREAD, NULL, cosim_thread, REF) != 0)
+  {
+    snprintf(COSIM_MACHINE->MESSAGE, sizeof(COSIM_MACHINE->MESSAGE),
+             "Can't start co-simulation thread");
+    COSIM_ACTIVE = COSIM_OFF;
+    COSIM_MACHINE = NULL;
+    return;
+  }
+  COSIM_ACTIVE = COSIM_RUNNING;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_cosim_start                                */
+/*                                                             */
+/* Purpose   : Start checking every retired instruction        */
+/*             against the ISA reference model.                */
+/*                                                             */
+/***************************************************************/
+int lc3b_cosim_start(lc3b_machine *m)
+{
+  if (COSIM_MACHINE == m)
+    return LC3B_OK;
+
+  if (COSIM_MACHINE != NULL)
+  {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "The reference model is in use by another machine");
+    return LC3B_ERROR;
+  }
+
+  if (REF == NULL && (REF = calloc(1, sizeof(Ref_Model))) == NULL)
+  {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't allocate reference model");
+    return LC3B_ERROR;
+  }
+
+  COSIM_MACHINE = m;
+  machine_enter(m);
+  if (FETCH_STATE[CURRENT_LATCHES.STATE_NUMBER])
+    cosim_begin(&CURRENT_LATCHES);
+  else
+    COSIM_ACTIVE = COSIM_PENDING;
+  machine_leave(m);
+
+  return COSIM_MACHINE == m ? LC3B_OK : LC3B_ERROR;
+}
+
+/* Wait for the reference model to stop and collect it. */
+static void cosim_join()
+{
+  atomic_store(&COSIM_QUIT, TRUE);
+  cosim_wake(&COSIM_WORK);
+  pthread_join(COSIM_THREAD, NULL);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : cosim_stop                                      */
+/*                                                             */
+/* Purpose   : Check the outstanding records and stop the      */
+/*             reference model.                                */
+/*                                                             */
+/***************************************************************/
+static void cosim_stop(lc3b_machine *m)
+{
+  if (COSIM_ACTIVE == COSIM_RUNNING && cosim_sync(m))
+    return;
+  if (COSIM_ACTIVE == COSIM_RUNNING)
+    cosim_join();
+  COSIM_ACTIVE = COSIM_OFF;
+  COSIM_MACHINE = NULL;
+}
+
+int lc3b_cosim_stop(lc3b_machine *m)
+{
+  int checked;
+
+  if (COSIM_MACHINE != m)
+    return 0;
+
+  machine_enter(m);
+  /* a model still waiting for an instruction boundary checked nothing */
+  checked = COSIM_ACTIVE == COSIM_RUNNING;
+  cosim_stop(m);
+  machine_leave(m);
+  return checked ? REF->INSTRUCTIONS : 0;
+}
+
+const char *lc3b_cosim_report(lc3b_machine *m)
+{
+  return m->REPORT;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : cosim_sync                                      */
+/*                                                             */
+/* Purpose   : Wait until the reference model has checked      */
+/*             every record. On a divergence keep the report,  */
+/*             halt the simulator and return TRUE.             */
+/*                                                             */
+/***************************************************************/
+static int cosim_sync(lc3b_machine *m)
+{
+  if (COSIM_ACTIVE != COSIM_RUNNING)
+    return FALSE;
+
+  cosim_sim_wait(atomic_load(&COSIM_HEAD), 0);
+
+  if (!atomic_load_explicit(&COSIM_DIVERGED, memory_order_acquire))
+    return FALSE;
+
+  cosim_join();
+  COSIM_ACTIVE = COSIM_OFF;
+  COSIM_MACHINE = NULL;
+  RUN_BIT = FALSE;
+  m->DIVERGED = TRUE;
+  memcpy(m->REPORT, COSIM_REPORT, sizeof(m->REPORT));
+
+  /* The model checks behind the simulator, up to a full queue of
+     instructions, so the machine has usually moved on. */
+  if (CYCLE_COUNT > COSIM_REPORT_CYCLE)
+  {
+    int n = strlen(m->REPORT);
+    snprintf(m->REPORT + n, sizeof(m->REPORT) - n,
+             "  The simulator ran on to cycle %d; its registers and memory are from there.\n",
+             CYCLE_COUNT);
+  }
+  return TRUE;
+}
+
+/* Called at the start of a cycle. */
+static void cosim_fetch()
+{
+  if (COSIM_ACTIVE >= COSIM_RUNNING && FETCH_STATE[CURRENT_LATCHES.STATE_NUMBER])
+    COSIM_RECORD.PC = CURRENT_LATCHES.PC;
+}
+
+/* Called when the microsequencer returns to the fetch state. */
+static void cosim_retire()
+{
+  unsigned head;
+
+  if (COSIM_ACTIVE == COSIM_PENDING)
+  {
+    cosim_begin(&NEXT_LATCHES);
+    return;
+  }
+
+  COSIM_RECORD.CYCLE = CYCLE_COUNT + 1;
+  COSIM_RECORD.IR = CURRENT_LATCHES.IR;
+  COSIM_RECORD.NEXT_PC = NEXT_LATCHES.PC;
+  COSIM_RECORD.N = NEXT_LATCHES.N;
+  COSIM_RECORD.Z = NEXT_LATCHES.Z;
+  COSIM_RECORD.P = NEXT_LATCHES.P;
+
+  if (COSIM_ACTIVE == COSIM_INLINE)
+  {
+    fuzz_retire();
+    cosim_clear_record();
+    return;
+  }
+
+  head = atomic_load_explicit(&COSIM_HEAD, memory_order_relaxed);
+  if (head - atomic_load_explicit(&COSIM_TAIL, memory_order_acquire) == COSIM_QUEUE_SIZE)
+    cosim_sim_wait(head, COSIM_QUEUE_SIZE - 1);
+
+  if (atomic_load_explicit(&COSIM_DIVERGED, memory_order_relaxed))
+  {
+    /* Stop at the next opportunity; cosim_sync collects the report. */
+    RUN_BIT = FALSE;
+    return;
+  }
+
+  COSIM_QUEUE[head & (COSIM_QUEUE_SIZE - 1)] = COSIM_RECORD;
+  atomic_store(&COSIM_HEAD, head + 1);
+  if (atomic_load(&COSIM_MODEL_WAITING) &&
+      head + 1 - atomic_load_explicit(&COSIM_TAIL, memory_order_relaxed) >= COSIM_BATCH)
+    cosim_wake(&COSIM_WORK);
+  cosim_clear_record();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Multi-core system ////////////////////////////////
+
+/* In system mode every core runs the shipped microcode on its own host
+   thread, starting from a copy of the machine state with R0 holding its
+   core number. The cores share MEMORY through a single bus. Threads run
+   QUANTUM cycles at a time and then wait for each other, so no core's
+   local cycle count gets more than one quantum ahead of another's.
+
+   The bus keeps every reservation that can still overlap an access in the
+   current quantum. An access starting at local cycle t can begin if it
+   overlaps none of them; otherwise the core's memory counter does not
+   advance and READY stays low until the bus frees up. With a quantum of 1
+   the cores run in lockstep and contention is modeled exactly, up to the
+   order of requests made in the same cycle. With a longer quantum every
+   conflict still costs a stall, but which core stalls, and for how long,
+   depends on the order the host threads reach the bus. */
+
+#define MAX_CORES 64
+
+/* One run of lc3b_run_system, shared by its cores, so that runs on
+   different machines don't meet. */
+struct System_Struct {
+  pthread_mutex_t MEMORY_LOCK;
+  pthread_mutex_t BUS_LOCK;
+  int *BUS_BUSY;		/* ring: BUS_BUSY[c % BUS_SLOTS] == c if cycle c is reserved */
+  int BUS_SLOTS;
+  atomic_int CORES_RUNNING;
+  pthread_barrier_t QUANTUM_BARRIER;
+  int QUANTUM;
+
+  /* Cores wait here until every thread has started, or been given up. */
+  pthread_mutex_t START_LOCK;
+  pthread_cond_t START_COND;
+  int START;			/* 0 waiting, 1 go, -1 abort */
+};
+
+typedef struct Core_Struct {
+  int ID;
+  lc3b_machine *MACHINE;
+  System *SYSTEM;
+  System_Latches LATCHES;
+  int CYCLES,			/* cycles simulated */
+      INSTRUCTIONS,		/* instructions retired */
+      BUS_STALLS;		/* cycles spent waiting for the bus */
+  pthread_t THREAD;
+} Core;
+
+static _Thread_local System *SYSTEM;
+static _Thread_local int BUS_STALLS;
+
+static void system_lock()
+{
+  pthread_mutex_lock(&SYSTEM->MEMORY_LOCK);
+}
+
+static void system_unlock()
+{
+  pthread_mutex_unlock(&SYSTEM->MEMORY_LOCK);
+}
+
+/* Try to reserve the bus for MEM_CYCLES cycles starting now. Counts a
+   stall cycle and returns FALSE if one of them is already reserved.
+   Every bus cycle an access could still overlap lies within a quantum
+   and two accesses of the current one, so a ring that long, holding
+   the cycle number each slot was last reserved for, never needs to be
+   cleared. */
+static int bus_acquire()
+{
+  System *s = SYSTEM;
+  int k, clear = TRUE;
+
+  pthread_mutex_lock(&s->BUS_LOCK);
+  for (k = CYCLE_COUNT; k < CYCLE_COUNT + MEM_CYCLES; k++)
+    if (s->BUS_BUSY[k % s->BUS_SLOTS] == k)
+      clear = FALSE;
+  if (clear)
+    for (k = CYCLE_COUNT; k < CYCLE_COUNT + MEM_CYCLES; k++)
+      s->BUS_BUSY[k % s->BUS_SLOTS] = k;
+  pthread_mutex_unlock(&s->BUS_LOCK);
+
+  if (!clear)
+    BUS_STALLS++;
+  return clear;
+}
+
+static void *core_thread(void *arg)
+{
+  Core *c = (Core *) arg;
+  int end = 0, running = TRUE, halted = FALSE, start;
+
+  pthread_mutex_lock(&c->SYSTEM->START_LOCK);
+  while ((start = c->SYSTEM->START) == 0)
+    pthread_cond_wait(&c->SYSTEM->START_COND, &c->SYSTEM->START_LOCK);
+  pthread_mutex_unlock(&c->SYSTEM->START_LOCK);
+  if (start < 0)
+    return NULL;
+
+  CORE_ID = c->ID;
+  SYSTEM = c->SYSTEM;
+  MEMORY = c->MACHINE->MEMORY;
+  CONTROL_STORE = c->MACHINE->CONTROL_STORE;
+  FETCH_STATE = c->MACHINE->FETCH_STATE;
+  WRITTEN = &c->MACHINE->WRITTEN;
+  BACKEND = NULL;		/* the shared bus sets the timing */
+  CURRENT_LATCHES = c->LATCHES;
+  NEXT_LATCHES = CURRENT_LATCHES;
+  CYCLE_COUNT = 0;
+  INSTRUCTION_COUNT = 0;
+  COUNT = 0;
+  BUS_STALLS = 0;
+  RUN_BIT = TRUE;
+
+  while (running)
+  {
+    end += SYSTEM->QUANTUM;
+    while (!halted && CYCLE_COUNT < end)
+    {
+      if (CURRENT_LATCHES.PC == 0x0000)
+      {
+        halted = TRUE;
+        atomic_fetch_sub(&SYSTEM->CORES_RUNNING, 1);
+        break;
+      }
+      cycle();
+    }
+
+    /* Everyone must see the same count before deciding to stop. */
+    pthread_barrier_wait(&SYSTEM->QUANTUM_BARRIER);
+    running = atomic_load(&SYSTEM->CORES_RUNNING) > 0;
+    pthread_barrier_wait(&SYSTEM->QUANTUM_BARRIER);
+  }
+
+  c->LATCHES = CURRENT_LATCHES;
+  c->CYCLES = CYCLE_COUNT;
+  c->INSTRUCTIONS = INSTRUCTION_COUNT;
+  c->BUS_STALLS = BUS_STALLS;
+  return NULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_run_system                                 */
+/*                                                             */
+/* Purpose   : Simulate num_cores LC-3b cores sharing memory   */
+/*             until all of them HALT, one host thread per     */
+/*             core, synchronizing every quantum cycles.       */
+/*                                                             */
+/***************************************************************/
+int lc3b_run_system(lc3b_machine *m, int num_cores, int quantum, lc3b_core_stats *stats)
+{
+  System system;
+  Core *cores;
+  int i, started;
+
+  if (m->CONTEXT.RUN_BIT == FALSE) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't simulate, Simulator is halted");
+    return LC3B_ERROR;
+  }
+  if (num_cores < 1 || num_cores > MAX_CORES || quantum < 1) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+             "need 1 to %d cores and a quantum of at least 1 cycle", MAX_CORES);
+    return LC3B_ERROR;
+  }
+  system.BUS_SLOTS = quantum < INT_MAX - 2 * MEM_CYCLES ? quantum + 2 * MEM_CYCLES : INT_MAX;
+  system.BUS_BUSY = malloc((size_t) system.BUS_SLOTS * sizeof(int));
+  cores = calloc(num_cores, sizeof(Core));
+  if (system.BUS_BUSY == NULL || cores == NULL) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't allocate cores");
+    free(system.BUS_BUSY);
+    free(cores);
+    return LC3B_ERROR;
+  }
+  for (i = 0; i < system.BUS_SLOTS; i++)
+    system.BUS_BUSY[i] = -1;
+
+  system.QUANTUM = quantum;
+  system.START = 0;
+  atomic_init(&system.CORES_RUNNING, num_cores);
+  pthread_mutex_init(&system.MEMORY_LOCK, NULL);
+  pthread_mutex_init(&system.BUS_LOCK, NULL);
+  pthread_mutex_init(&system.START_LOCK, NULL);
+  pthread_cond_init(&system.START_COND, NULL);
+  pthread_barrier_init(&system.QUANTUM_BARRIER, NULL, num_cores);
+
+  for (started = 0; started < num_cores; started++) {
+    cores[started].ID = started;
+    cores[started].MACHINE = m;
+    cores[started].SYSTEM = &system;
+    cores[started].LATCHES = m->CONTEXT.LATCHES;
+    cores[started].LATCHES.REGS[0] = started;
+    if (pthread_create(&cores[started].THREAD, NULL, core_thread, &cores[started]) != 0)
+      break;
+  }
+
+  /* The barrier could never fill without every core, so either all of
+     them run or none do. */
+  pthread_mutex_lock(&system.START_LOCK);
+  system.START = started < num_cores ? -1 : 1;
+  pthread_cond_broadcast(&system.START_COND);
+  pthread_mutex_unlock(&system.START_LOCK);
+  for (i = 0; i < started; i++)
+    pthread_join(cores[i].THREAD, NULL);
+
+  pthread_barrier_destroy(&system.QUANTUM_BARRIER);
+  pthread_cond_destroy(&system.START_COND);
+  pthread_mutex_destroy(&system.START_LOCK);
+  pthread_mutex_destroy(&system.MEMORY_LOCK);
+  pthread_mutex_destroy(&system.BUS_LOCK);
+  free(system.BUS_BUSY);
+
+  if (started < num_cores) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't start thread for core %d", started);
+    free(cores);
+    return LC3B_ERROR;
+  }
+
+  for (i = 0; i < num_cores; i++) {
+    stats[i].cycles = cores[i].CYCLES;
+    stats[i].instructions = cores[i].INSTRUCTIONS;
+    stats[i].bus_stalls = cores[i].BUS_STALLS;
+  }
+  free(cores);
+
+  /* The cores didn't log their writes, so older history is useless. */
+  if (HISTORY_MACHINE == m) {
+    machine_enter(m);
+    snapshot_reset();
+    machine_leave(m);
+  }
+  return LC3B_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Reverse execution ////////////////////////////////
+
+/* Every SNAPSHOT_INTERVAL cycles the latches are copied into a ring of
+   snapshots, and every MEM_WRITE logs the word it overwrites. To go back
+   to cycle c the undo log is rolled back to the newest snapshot at or
+   before c, the snapshot is restored and the machine runs forward to c,
+   so the cost of a step back is bounded by the interval plus the writes
+   made since that snapshot.
+
+   Half of the budget holds snapshots and half the undo log. When either
+   fills up the oldest snapshot is dropped, along with the undo entries
+   that only it needed. */
+
+typedef struct Snapshot_Struct {
+  int CYCLE;
+  System_Latches LATCHES;
+  int BUS, COUNT, RUN_BIT, INSTRUCTION_COUNT, MEM_LATENCY;
+  Backend_Timing TIMING;	/* of the memory backend */
+  long UNDO_POS;		/* undo log position when taken */
+} Snapshot;
+
+typedef struct Undo_Entry_Struct {
+  int WORD;
+  int OLD[2];
+} Undo_Entry;
+
+static _Thread_local int SNAPSHOT_INTERVAL;	/* 0 when reverse execution is off */
+static _Thread_local int NEXT_SNAPSHOT = -1;
+
+static Snapshot *SNAPSHOTS;
+static long SNAPSHOT_SLOTS, SNAPSHOT_HEAD, SNAPSHOT_TAIL;	/* ring, absolute positions */
+
+static lc3b_machine *HISTORY_MACHINE;	/* the machine the history belongs to */
+static int HISTORY_REACHED;		/* furthest cycle it has simulated */
+
+static Undo_Entry *UNDO_LOG;
+static long UNDO_SLOTS, UNDO_HEAD, UNDO_TAIL;			/* ring, absolute positions */
+
+#define SNAPSHOT_AT(i) (&SNAPSHOTS[(i) % SNAPSHOT_SLOTS])
+#define UNDO_AT(i)     (&UNDO_LOG[(i) % UNDO_SLOTS])
+
+/* Forget the oldest snapshot and the undo entries only it could use. */
+static void snapshot_drop_oldest()
+{
+  SNAPSHOT_TAIL++;
+  if (SNAPSHOT_TAIL == SNAPSHOT_HEAD)
+    UNDO_TAIL = UNDO_HEAD;
+  else
+    UNDO_TAIL = SNAPSHOT_AT(SNAPSHOT_TAIL)->UNDO_POS;
+}
+
+static void snapshot_take()
+{
+  Snapshot *snap;
+
+  /* One taken earlier in the same cycle is out of date. */
+  if (SNAPSHOT_HEAD != SNAPSHOT_TAIL && SNAPSHOT_AT(SNAPSHOT_HEAD - 1)->CYCLE == CYCLE_COUNT)
+    SNAPSHOT_HEAD--;
+  if (SNAPSHOT_HEAD - SNAPSHOT_TAIL == SNAPSHOT_SLOTS)
+    snapshot_drop_oldest();
+
+  snap = SNAPSHOT_AT(SNAPSHOT_HEAD);
+  snap->CYCLE = CYCLE_COUNT;
+  snap->LATCHES = CURRENT_LATCHES;
+  snap->BUS = BUS;
+  snap->COUNT = COUNT;
+  snap->MEM_LATENCY = MEM_LATENCY;
+  snap->TIMING = BACKEND->TIMING;
+  snap->RUN_BIT = RUN_BIT;
+  snap->INSTRUCTION_COUNT = INSTRUCTION_COUNT;
+  snap->UNDO_POS = UNDO_HEAD;
+  SNAPSHOT_HEAD++;
+
+  NEXT_SNAPSHOT = CYCLE_COUNT + SNAPSHOT_INTERVAL;
+}
+
+static void undo_record(int word)
+{
+  Undo_Entry *entry;
+
+  /* Snapshots taken with no writes between them share an undo
+     position, so dropping one may free nothing: keep going. */
+  while (UNDO_HEAD - UNDO_TAIL == UNDO_SLOTS && SNAPSHOT_TAIL != SNAPSHOT_HEAD)
+    snapshot_drop_oldest();
+
+  /* No snapshot left to rewind to means nothing to log for. */
+  if (SNAPSHOT_TAIL == SNAPSHOT_HEAD)
+    return;
+
+  entry = UNDO_AT(UNDO_HEAD);
+  entry->WORD = word;
+  entry->OLD[0] = MEMORY[word][0];
+  entry->OLD[1] = MEMORY[word][1];
+  UNDO_HEAD++;
+}
+
+/* The API changes memory and latches between cycles, where MEM_WRITE
+   doesn't see it. Log the word about to change, if not -1, and snapshot
+   the latches, which must already hold any change to them: going back
+   before this cycle then undoes the change and going back to it or later
+   keeps it. */
+static void history_edit(lc3b_machine *m, int word)
+{
+  if (HISTORY_MACHINE != m)
+    return;
+  machine_enter(m);
+  if (word >= 0)
+    undo_record(word);
+  snapshot_take();
+  machine_leave(m);
+}
+
+/* Throw away the history and start again from the current cycle. */
+static void snapshot_reset()
+{
+  if (SNAPSHOT_INTERVAL == 0)
+    return;
+  SNAPSHOT_HEAD = SNAPSHOT_TAIL = 0;
+  UNDO_HEAD = UNDO_TAIL = 0;
+  HISTORY_REACHED = CYCLE_COUNT;
+  snapshot_take();
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_history                                    */
+/*                                                             */
+/* Purpose   : Take a snapshot every interval cycles, keeping  */
+/*             at most budget_kb kilobytes of history. An      */
+/*             interval of 0 turns reverse execution off.      */
+/*                                                             */
+/***************************************************************/
+int lc3b_history(lc3b_machine *m, int interval, int budget_kb)
+{
+  long budget = (long) budget_kb * 1024;
+
+  if (HISTORY_MACHINE != NULL && HISTORY_MACHINE != m) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "History is kept for another machine");
+    return LC3B_ERROR;
+  }
+
+  machine_enter(m);
+  free(SNAPSHOTS);
+  free(UNDO_LOG);
+  SNAPSHOTS = NULL;
+  UNDO_LOG = NULL;
+  SNAPSHOT_INTERVAL = 0;
+  NEXT_SNAPSHOT = -1;
+  HISTORY_MACHINE = NULL;
+
+  if (interval > 0) {
+    SNAPSHOT_SLOTS = budget / 2 / sizeof(Snapshot);
+    UNDO_SLOTS = budget / 2 / sizeof(Undo_Entry);
+    if (SNAPSHOT_SLOTS < 2 || UNDO_SLOTS < 1)
+      snprintf(m->MESSAGE, sizeof(m->MESSAGE), "A budget of %d KB is too small", budget_kb);
+    else if ((SNAPSHOTS = malloc(SNAPSHOT_SLOTS * sizeof(Snapshot))) == NULL ||
+             (UNDO_LOG = malloc(UNDO_SLOTS * sizeof(Undo_Entry))) == NULL) {
+      snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't allocate %d KB of history", budget_kb);
+      free(SNAPSHOTS);
+      SNAPSHOTS = NULL;
+    }
+    else {
+      SNAPSHOT_INTERVAL = interval;
+      HISTORY_MACHINE = m;
+      snapshot_reset();
+    }
+  }
+  machine_leave(m);
+
+  return (interval > 0 && HISTORY_MACHINE == NULL) ? LC3B_ERROR : LC3B_OK;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_goto_cycle                                 */
+/*                                                             */
+/* Purpose   : Restore the machine to the state it was in at   */
+/*             target_cycle.                                   */
+/*                                                             */
+/***************************************************************/
+int lc3b_goto_cycle(lc3b_machine *m, int target_cycle)
+{
+  long i, found;
+  Snapshot *snap;
+  Undo_Entry *entry;
+  Activity *activity;
+  FILE *trace_file;
+  int stop;
+
+  if (HISTORY_MACHINE != m) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Reverse execution is off");
+    return LC3B_ERROR;
+  }
+  if (SNAPSHOT_TAIL == SNAPSHOT_HEAD || target_cycle < SNAPSHOT_AT(SNAPSHOT_TAIL)->CYCLE) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Cycle %d is older than the history kept", target_cycle);
+    return LC3B_ERROR;
+  }
+
+  machine_enter(m);
+
+  /* The reference model can't follow the machine backwards. */
+  if (COSIM_ACTIVE) cosim_stop(m);
+
+  if (CYCLE_COUNT > HISTORY_REACHED)
+    HISTORY_REACHED = CYCLE_COUNT;
+
+  if (target_cycle < CYCLE_COUNT) {
+    for (found = SNAPSHOT_HEAD - 1; SNAPSHOT_AT(found)->CYCLE > target_cycle; found--);
+    snap = SNAPSHOT_AT(found);
+
+    for (i = UNDO_HEAD - 1; i >= snap->UNDO_POS; i--) {
+      entry = UNDO_AT(i);
+      MEMORY[entry->WORD][0] = entry->OLD[0];
+      MEMORY[entry->WORD][1] = entry->OLD[1];
+      mark_written(entry->WORD);
+    }
+    UNDO_HEAD = snap->UNDO_POS;
+    SNAPSHOT_HEAD = found + 1;
+
+    CURRENT_LATCHES = snap->LATCHES;
+    NEXT_LATCHES = CURRENT_LATCHES;
+    BUS = snap->BUS;
+    COUNT = snap->COUNT;
+    MEM_LATENCY = snap->MEM_LATENCY;
+    BACKEND->TIMING = snap->TIMING;
+    RUN_BIT = snap->RUN_BIT;
+    CYCLE_COUNT = snap->CYCLE;
+    INSTRUCTION_COUNT = snap->INSTRUCTION_COUNT;
+    NEXT_SNAPSHOT = CYCLE_COUNT + SNAPSHOT_INTERVAL;
+  }
+
+  /* Cycles simulated before were already counted and traced; only
+     count and trace the ones past them. */
+  activity = ACTIVITY;
+  trace_file = TRACE_FILE;
+  ACTIVITY = NULL;
+  TRACE_FILE = NULL;
+  stop = target_cycle < HISTORY_REACHED ? target_cycle : HISTORY_REACHED;
+
+  if (LIVE) live_begin();
+  while (CYCLE_COUNT < target_cycle && CURRENT_LATCHES.PC != 0x0000) {
+    if (CYCLE_COUNT == stop) {
+      ACTIVITY = activity;
+      TRACE_FILE = trace_file;
+      stop = target_cycle;
+    }
+    if (!FUSION || fused_step(stop - CYCLE_COUNT) == 0)
+      cycle();
+  }
+  ACTIVITY = activity;
+  TRACE_FILE = trace_file;
+  if (CURRENT_LATCHES.PC == 0x0000)
+    RUN_BIT = FALSE;
+  if (LIVE) live_publish(LIVE_IDLE);
+  machine_leave(m);
+
+  return LC3B_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Timing replay ////////////////////////////////////
+
+/* A trace holds the microstates a run went through and the memory accesses
+   it made, with the cycles spent waiting for memory taken out. That is all
+   the timing of the machine depends on, so a replay can charge each access
+   whatever a different memory system would take without evaluating the
+   datapath again.
+
+   The trace starts with "LC3T" and a u16 version, followed by one entry
+   per microstate visited:
+
+     state | TRACE_FETCH                      a fetch state
+     state                                    any other state
+     state | TRACE_MEMORY [| TRACE_WRITE],    a memory access, with its
+       DATA_SIZE, MAR low byte, MAR high byte   width and byte address   */
+
+#define TRACE_MAGIC   "LC3T"
+#define TRACE_VERSION 1
+#define TRACE_STATE   0x3F
+#define TRACE_MEMORY  0x40
+#define TRACE_FETCH   0x80	/* without TRACE_MEMORY */
+#define TRACE_WRITE   0x80	/* with TRACE_MEMORY */
+
+static _Thread_local FILE *TRACE_FILE;
+
+/* Called at the start of a cycle. */
+static void trace_cycle()
+{
+  int *u = CURRENT_LATCHES.MICROINSTRUCTION;
+  int state = CURRENT_LATCHES.STATE_NUMBER;
+
+  if (!GetMIO_EN(u)) {
+    putc(state | (FETCH_STATE[state] ? TRACE_FETCH : 0), TRACE_FILE);
+    return;
+  }
+
+  /* Only the first cycle of an access; the rest is waiting. */
+  if (COUNT != 0)
+    return;
+  putc(state | TRACE_MEMORY | (GetR_W(u) ? TRACE_WRITE : 0), TRACE_FILE);
+  putc(GetDATA_SIZE(u), TRACE_FILE);
+  putc(CURRENT_LATCHES.MAR & 0xFF, TRACE_FILE);
+  putc((CURRENT_LATCHES.MAR >> 8) & 0xFF, TRACE_FILE);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_trace_start                                */
+/*                                                             */
+/* Purpose   : Record the microstates and memory accesses of   */
+/*             every following cycle to trace_file.            */
+/*                                                             */
+/***************************************************************/
+int lc3b_trace_start(lc3b_machine *m, FILE *trace_file)
+{
+  unsigned char header[6];
+
+  memcpy(header, TRACE_MAGIC, 4);
+  dump_put16(header + 4, TRACE_VERSION);
+  if (fwrite(header, 1, sizeof(header), trace_file) != sizeof(header)) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't write trace");
+    return LC3B_ERROR;
+  }
+  m->CONTEXT.TRACE_FILE = trace_file;
+  return LC3B_OK;
+}
+
+void lc3b_trace_stop(lc3b_machine *m)
+{
+  m->CONTEXT.TRACE_FILE = NULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_trace_replay                               */
+/*                                                             */
+/* Purpose   : Work out how many cycles the run in trace_file  */
+/*             would have taken with the given memory timing.  */
+/*                                                             */
+/***************************************************************/
+int lc3b_trace_replay(FILE *trace_file, const lc3b_timing *timing, lc3b_replay_stats *stats)
+{
+  unsigned char header[6];
+  int *tags = NULL, entry, address, line, sets, cost;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (fread(header, 1, sizeof(header), trace_file) != sizeof(header) ||
+      memcmp(header, TRACE_MAGIC, 4) != 0 || dump_get16(header + 4) != TRACE_VERSION)
+    return LC3B_ERROR;
+
+  sets = timing->cache_lines;
+  if (timing->mem_cycles < 1 || sets < 0 ||
+      (sets > 0 && (timing->line_bytes < 2 || timing->hit_cycles < 1)))
+    return LC3B_ERROR;
+  if (sets > 0) {
+    if ((tags = malloc(sets * sizeof(int))) == NULL)
+      return LC3B_ERROR;
+    for (line = 0; line < sets; line++)
+      tags[line] = -1;
+  }
+
+  while ((entry = getc_unlocked(trace_file)) != EOF) {
+    if (!(entry & TRACE_MEMORY)) {
+      stats->cycles++;
+      if (entry & TRACE_FETCH) stats->instructions++;
+      continue;
+    }
+
+    getc_unlocked(trace_file);		/* DATA_SIZE doesn't change the timing */
+    address = getc_unlocked(trace_file);
+    address |= getc_unlocked(trace_file) << 8;
+    if (address < 0)
+      break;			/* truncated by a crash, keep what is there */
+
+    if (entry & TRACE_WRITE) stats->writes++;
+    else stats->reads++;
+
+    /* Direct mapped and write through: writes always go to memory and
+       only reads allocate. */
+    cost = timing->mem_cycles;
+    if (sets > 0) {
+      address /= timing->line_bytes;
+      line = address % sets;
+      if (entry & TRACE_WRITE) {
+        if (tags[line] == address) stats->write_hits++;
+        else stats->write_misses++;
+      }
+      else if (tags[line] == address) {
+        stats->hits++;
+        cost = timing->hit_cycles;
+      }
+      else {
+        stats->misses++;
+        tags[line] = address;
+      }
+    }
+    stats->cycles += cost;
+  }
+
+  free(tags);
+  return LC3B_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Switching activity ///////////////////////////////
+
+/* Bit toggles are counted as the popcount of the old value XOR the new
+   one, and only for latches whose load enable is asserted. Gates and load
+   enables are not counted per cycle: the cycles spent in each microstate
+   are, and lc3b_activity_counts multiplies them out with the control
+   store, so counting costs a few instructions per cycle. */
+
+static _Thread_local Activity *ACTIVITY;	/* NULL when not counting */
+
+#define TOGGLES(a, b) __builtin_popcount(((a) ^ (b)) & 0xFFFF)
+
+/* Called at the end of a cycle, before the latches are updated. */
+static void activity_cycle()
+{
+  unsigned long long *n = ACTIVITY->COUNTS;
+  int k;
+
+  ACTIVITY->STATE_CYCLES[CURRENT_LATCHES.STATE_NUMBER]++;
+  n[LC3B_ACT_BUS] += TOGGLES(BUS, ACTIVITY->LAST_BUS);
+  ACTIVITY->LAST_BUS = BUS;
+
+  if (x[LD_PC])  n[LC3B_ACT_PC] += TOGGLES(CURRENT_LATCHES.PC, NEXT_LATCHES.PC);
+  if (x[LD_IR])  n[LC3B_ACT_IR] += TOGGLES(CURRENT_LATCHES.IR, NEXT_LATCHES.IR);
+  if (x[LD_MAR]) n[LC3B_ACT_MAR] += TOGGLES(CURRENT_LATCHES.MAR, NEXT_LATCHES.MAR);
+  /* MDR is also loaded by a memory read completing */
+  n[LC3B_ACT_MDR] += TOGGLES(CURRENT_LATCHES.MDR, NEXT_LATCHES.MDR);
+  if (x[LD_REG])
+    for (k = 0; k < LC_3b_REGS; k++)
+      n[LC3B_ACT_REGS] += TOGGLES(CURRENT_LATCHES.REGS[k], NEXT_LATCHES.REGS[k]);
+}
+
+static void activity_read(int value)
+{
+  ACTIVITY->COUNTS[LC3B_ACT_MEM_READS]++;
+  ACTIVITY->COUNTS[LC3B_ACT_MEM_READ_BITS] += TOGGLES(value, ACTIVITY->LAST_READ);
+  ACTIVITY->LAST_READ = value;
+}
+
+/* Called before MEM_WRITE changes the word. */
+static void activity_write(int word)
+{
+  int old = MEMORY[word][1] << 8 | MEMORY[word][0];
+  int value = CURRENT_LATCHES.MDR;
+
+  if (GetDATA_SIZE(x) == 0)
+    value = (CURRENT_LATCHES.MAR & 1) ? (old & 0x00FF) | (value & 0xFF) << 8
+                                      : (old & 0xFF00) | (value & 0xFF);
+  ACTIVITY->COUNTS[LC3B_ACT_MEM_WRITES]++;
+  ACTIVITY->COUNTS[LC3B_ACT_MEM_WRITE_BITS] += TOGGLES(old, value);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_activity                                   */
+/*                                                             */
+/* Purpose   : Start counting switching activity from zero, or */
+/*             stop counting and keep the counts.              */
+/*                                                             */
+/***************************************************************/
+void lc3b_activity(lc3b_machine *m, int on)
+{
+  if (on) {
+    memset(&m->COUNTERS, 0, sizeof(m->COUNTERS));
+    m->COUNTERS.LAST_BUS = m->CONTEXT.BUS;
+    m->COUNTERS.LAST_READ = m->CONTEXT.LATCHES.MDR;
+  }
+  m->COUNTING = on;
+}
+
+/* Fold the cycles spent in each microstate into the gate and load enable
+   counts, using the control store the cycles were spent with. */
+static void activity_fold(lc3b_machine *m)
+{
+  unsigned long long *n = m->COUNTERS.COUNTS, cycles;
+  int state, k;
+
+  for (state = 0; state < CONTROL_STORE_ROWS; state++) {
+    cycles = m->COUNTERS.STATE_CYCLES[state];
+    if (cycles == 0)
+      continue;
+    n[LC3B_ACT_CYCLES] += cycles;
+    /* LD_MAR..LD_PC and GATE_PC..GATE_SHF are adjacent in the control
+       store word and in the counters. */
+    for (k = 0; k <= GATE_SHF - LD_MAR; k++)
+      n[LC3B_ACT_LD_MAR + k] += cycles * m->CONTROL_STORE[state][LD_MAR + k];
+    m->COUNTERS.STATE_CYCLES[state] = 0;
+  }
+}
+
+void lc3b_activity_counts(lc3b_machine *m, unsigned long long counts[LC3B_ACTIVITY_COUNTERS])
+{
+  activity_fold(m);
+  memcpy(counts, m->COUNTERS.COUNTS, sizeof(m->COUNTERS.COUNTS));
+}
+
+const char *lc3b_activity_name(int counter)
+{
+  static const char *names[LC3B_ACTIVITY_COUNTERS] = {
+    "CYCLES", "BUS", "PC", "IR", "MAR", "MDR", "REGS",
+    "MEM_READS", "MEM_READ_BITS", "MEM_WRITES", "MEM_WRITE_BITS",
+    "LD_MAR", "LD_MDR", "LD_IR", "LD_BEN", "LD_REG", "LD_CC", "LD_PC",
+    "GATE_PC", "GATE_MDR", "GATE_ALU", "GATE_MARMUX", "GATE_SHF"
+  };
+
+  if (counter < 0 || counter >= LC3B_ACTIVITY_COUNTERS)
+    return NULL;
+  return names[counter];
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Memory backends //////////////////////////////////
+
+/* Each machine has one backend, selected by lc3b_set_memory, that times its
+   memory accesses. The data itself always lives in MEMORY. System mode
+   cores use the fixed MEM_CYCLES timing of the shared bus instead. */
+
+static _Thread_local Memory_Backend *BACKEND;	/* NULL in system mode */
+static _Thread_local int MEM_LATENCY = MEM_CYCLES;	/* of the access in progress */
+
+static int fixed_access(Memory_Backend *b, int word, int write)
+{
+  (void) word;
+  (void) write;
+  return b->LATENCY;
+}
+
+/* Low-order interleaved banks, each with one open row. A bank stays busy
+   for BUSY cycles after an access before it can start the next one. */
+static int banked_access(Memory_Backend *b, int word, int write)
+{
+  Backend_Timing *t = &b->TIMING;
+  int bank = word % b->BANKS;
+  int row = word / b->BANKS / b->ROW_WORDS;
+  int start = CYCLE_COUNT > t->BANK_FREE[bank] ? CYCLE_COUNT : t->BANK_FREE[bank];
+  int done = start + (t->OPEN_ROW[bank] == row ? b->HIT : b->MISS);
+
+  (void) write;
+  t->OPEN_ROW[bank] = row;
+  t->BANK_FREE[bank] = done + b->BUSY;
+  return done - CYCLE_COUNT < 2 ? 2 : done - CYCLE_COUNT;
+}
+
+/* Stores are posted to a FIFO in POST cycles and drain to memory in the
+   background, LATENCY cycles each. A store waits only when the buffer is
+   full. Reads wait for the buffer to drain, so they never see stale data. */
+static int write_buffer_access(Memory_Backend *b, int word, int write)
+{
+  Backend_Timing *t = &b->TIMING;
+  int start = CYCLE_COUNT, done;
+
+  (void) word;
+  while (t->POSTED_COUNT > 0 && t->POSTED[t->POSTED_HEAD] <= CYCLE_COUNT) {
+    t->POSTED_HEAD = (t->POSTED_HEAD + 1) % MAX_POSTED;
+    t->POSTED_COUNT--;
+  }
+
+  if (!write) {
+    done = (t->PORT_FREE > start ? t->PORT_FREE : start) + b->LATENCY;
+    t->PORT_FREE = done;
+    return done - CYCLE_COUNT;
+  }
+
+  if (t->POSTED_COUNT == b->DEPTH) {
+    start = t->POSTED[t->POSTED_HEAD];
+    t->POSTED_HEAD = (t->POSTED_HEAD + 1) % MAX_POSTED;
+    t->POSTED_COUNT--;
+  }
+  done = (t->PORT_FREE > start ? t->PORT_FREE : start) + b->LATENCY;
+  t->PORT_FREE = done;
+  t->POSTED[(t->POSTED_HEAD + t->POSTED_COUNT) % MAX_POSTED] = done;
+  t->POSTED_COUNT++;
+  return start - CYCLE_COUNT + b->POST;
+}
+
+/* Read the ":n" fields after a backend name into fields, in order. Fields
+   may be left off the end. Returns the number read, or -1 if the text
+   holds anything else. */
+static int backend_fields(const char *text, int *fields[], int max)
+{
+  int i, n;
+
+  for (i = 0; i < max && *text != '\0'; i++) {
+    if (sscanf(text, ":%d%n", fields[i], &n) != 1)
+      return -1;
+    text += n;
+  }
+  return *text == '\0' ? i : -1;
+}
+
+/* Forget the timing state, as at power on. */
+static void backend_reset(Memory_Backend *b)
+{
+  Backend_Timing *t = &b->TIMING;
+  int i;
+
+  for (i = 0; i < MAX_BANKS; i++) {
+    t->BANK_FREE[i] = 0;
+    t->OPEN_ROW[i] = -1;
+  }
+  t->POSTED_HEAD = t->POSTED_COUNT = 0;
+  t->PORT_FREE = 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_set_memory                                 */
+/*                                                             */
+/* Purpose   : Select the memory backend from a spec string.   */
+/*                                                             */
+/***************************************************************/
+int lc3b_set_memory(lc3b_machine *m, const char *spec)
+{
+  Memory_Backend b;
+  char kind[16];
+  const char *format;
+  int n, fields = 0;
+
+  memset(&b, 0, sizeof(b));
+  b.LATENCY = MEM_CYCLES;
+  b.BANKS = 4; b.HIT = 3; b.MISS = MEM_CYCLES; b.ROW_WORDS = 64; b.BUSY = 2;
+  b.DEPTH = 4; b.POST = 2;
+
+  if (m->CONTEXT.COUNT != 0) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "A memory access is in progress");
+    return LC3B_ERROR;
+  }
+
+  if (spec == NULL || spec[0] == '\0')
+    spec = "fixed";
+  if (sscanf(spec, "%15[a-z]%n", kind, &n) != 1) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Unknown memory backend %s", spec);
+    return LC3B_ERROR;
+  }
+
+  if (strcmp(kind, "fixed") == 0) {
+    int *f[] = { &b.LATENCY };
+    fields = backend_fields(spec + n, f, 1);
+    format = "fixed:c";
+    b.ACCESS = fixed_access;
+    snprintf(b.SPEC, sizeof(b.SPEC), "fixed:%d", b.LATENCY);
+  }
+  else if (strcmp(kind, "banked") == 0) {
+    int *f[] = { &b.BANKS, &b.HIT, &b.MISS, &b.ROW_WORDS, &b.BUSY };
+    fields = backend_fields(spec + n, f, 5);
+    format = "banked:n:h:m:r:b";
+    b.ROW_WORDS /= 2;		/* given in bytes */
+    b.ACCESS = banked_access;
+    snprintf(b.SPEC, sizeof(b.SPEC), "banked:%d:%d:%d:%d:%d",
+             b.BANKS, b.HIT, b.MISS, b.ROW_WORDS * 2, b.BUSY);
+  }
+  else if (strcmp(kind, "wbuf") == 0) {
+    int *f[] = { &b.LATENCY, &b.DEPTH, &b.POST };
+    fields = backend_fields(spec + n, f, 3);
+    format = "wbuf:c:d:p";
+    b.ACCESS = write_buffer_access;
+    snprintf(b.SPEC, sizeof(b.SPEC), "wbuf:%d:%d:%d", b.LATENCY, b.DEPTH, b.POST);
+  }
+  else {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Unknown memory backend %s", kind);
+    return LC3B_ERROR;
+  }
+  if (fields < 0) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+             "Bad memory spec %s, expected %s with fields left off the end only", spec, format);
+    return LC3B_ERROR;
+  }
+
+  /* READY needs a cycle of its own before the data moves. */
+  if (b.LATENCY < 2 || b.HIT < 2 || b.MISS < 2 || b.POST < 2 || b.BUSY < 0 ||
+      b.BANKS < 1 || b.BANKS > MAX_BANKS || b.ROW_WORDS < 1 ||
+      b.DEPTH < 1 || b.DEPTH > MAX_POSTED) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE),
+             "Invalid memory timing %s: accesses take at least 2 cycles, "
+             "up to %d banks and %d posted writes", spec, MAX_BANKS, MAX_POSTED);
+    return LC3B_ERROR;
+  }
+
+  backend_reset(&b);
+  m->BACKEND = b;
+
+  /* Older snapshots hold the old backend's timing. */
+  if (HISTORY_MACHINE == m) {
+    machine_enter(m);
+    snapshot_reset();
+    machine_leave(m);
+  }
+  return LC3B_OK;
+}
+
+const char *lc3b_memory(lc3b_machine *m)
+{
+  return m->BACKEND.SPEC;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Live statistics //////////////////////////////////
+
+/* A machine can publish its progress to a Live_Page (see lc3blive.h) in a
+   shared file, every INTERVAL cycles and whenever a step call returns.
+   Other processes map the file and read it under the page's seqlock, so
+   the simulator never waits for them. */
+
+static _Thread_local Live *LIVE;		/* NULL when not publishing */
+
+static double live_now()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Start timing a step call; time spent between calls is not counted. */
+static void live_begin()
+{
+  LIVE->LAST_CYCLE = CYCLE_COUNT;
+  LIVE->LAST_TIME = live_now();
+  LIVE->NEXT = CYCLE_COUNT + LIVE->INTERVAL;
+  live_publish(LIVE_RUNNING);
+}
+
+static void live_publish(int status)
+{
+  volatile Live_Page *page = LIVE->PAGE;
+  uint32_t sequence = page->SEQUENCE;
+  struct timespec stamp;
+  double now = live_now();
+
+  if (status == LIVE_IDLE && !RUN_BIT)
+    status = LIVE_HALTED;
+
+  /* An odd sequence tells readers to retry until the update is done. */
+  __atomic_store_n(&page->SEQUENCE, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  page->STATUS = status;
+  page->PC = CURRENT_LATCHES.PC;
+  page->STATE_NUMBER = CURRENT_LATCHES.STATE_NUMBER;
+  page->INTERVAL = LIVE->INTERVAL;
+  page->CYCLES = CYCLE_COUNT;
+  page->INSTRUCTIONS = INSTRUCTION_COUNT;
+  page->MEM_READS = LIVE->READS;
+  page->MEM_WRITES = LIVE->WRITES;
+  if (status != LIVE_RUNNING)
+    page->CYCLES_PER_SECOND = 0;
+  else if (now > LIVE->LAST_TIME && CYCLE_COUNT != LIVE->LAST_CYCLE)
+    page->CYCLES_PER_SECOND = (CYCLE_COUNT - LIVE->LAST_CYCLE) / (now - LIVE->LAST_TIME);
+  clock_gettime(CLOCK_REALTIME, &stamp);
+  page->UPDATED_NS = stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+
+  __atomic_store_n(&page->SEQUENCE, sequence + 2, __ATOMIC_RELEASE);
+
+  LIVE->LAST_CYCLE = CYCLE_COUNT;
+  LIVE->LAST_TIME = now;
+  LIVE->NEXT = CYCLE_COUNT + LIVE->INTERVAL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_live_start                                 */
+/*                                                             */
+/* Purpose   : Publish live statistics to a shared file.       */
+/*                                                             */
+/***************************************************************/
+int lc3b_live_start(lc3b_machine *m, const char *path, int interval)
+{
+  Live_Page *page;
+  int fd;
+
+  if (interval < 1) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "The update interval must be at least 1 cycle");
+    return LC3B_ERROR;
+  }
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't open statistics file %s", path);
+    return LC3B_ERROR;
+  }
+  if (ftruncate(fd, sizeof(Live_Page)) != 0 ||
+      (page = mmap(NULL, sizeof(Live_Page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't map statistics file %s", path);
+    close(fd);
+    return LC3B_ERROR;
+  }
+  close(fd);
+
+  lc3b_live_stop(m);
+  memcpy(page->MAGIC, LIVE_MAGIC, 4);
+  page->VERSION = LIVE_VERSION;
+  page->PID = getpid();
+
+  m->LIVE.PAGE = page;
+  m->LIVE.INTERVAL = interval;
+  m->LIVE.READS = m->LIVE.WRITES = 0;
+  machine_enter(m);
+  live_begin();
+  live_publish(LIVE_IDLE);
+  machine_leave(m);
+  return LC3B_OK;
+}
+
+/* Mark the page detached and stop publishing. The file is left behind. */
+void lc3b_live_stop(lc3b_machine *m)
+{
+  volatile Live_Page *page = m->LIVE.PAGE;
+
+  if (page == NULL)
+    return;
+  machine_enter(m);
+  live_publish(LIVE_DETACHED);
+  machine_leave(m);
+  munmap((void *)page, sizeof(Live_Page));
+  m->LIVE.PAGE = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Fuzzing //////////////////////////////////////////
+
+/* lc3b_fuzz_start keeps a copy of the machine as the base every input runs
+   from. An input is written over memory at the base PC and run for a cycle
+   budget, with every retired instruction checked against a private
+   reference model on the simulator's own thread. Only the words in the
+   machine's write tracker can differ from the base, so going back to it
+   costs one copy per word written rather than one of all of memory. The
+   reference model's stores are tracked the same way.
+
+   Coverage is kept as two bitmaps: microstate transitions and the PCs of
+   retired instructions. A run reports the bits it set for the first time,
+   so a driver can keep the inputs that reach new behaviour. */
+
+#define FUZZ_STATE_BITS (CONTROL_STORE_ROWS * CONTROL_STORE_ROWS)
+
+struct Fuzz_Struct {
+  Core_Context CONTEXT;		/* the base */
+  Memory_Backend BACKEND;
+  int MEMORY[WORDS_IN_MEM][2];
+  Ref_Model REF;
+  unsigned char STATES[FUZZ_STATE_BITS / 8];	/* transitions seen */
+  unsigned char PCS[WORDS_IN_MEM / 8];		/* word addresses retired */
+  int NEW_STATES, NEW_PCS;	/* first seen in the current run */
+  int TOTAL_STATES, TOTAL_PCS;
+  lc3b_machine *MACHINE;
+};
+
+static _Thread_local Fuzz *FUZZ;	/* NULL unless inside lc3b_fuzz_run */
+
+static void fuzz_cycle()
+{
+  int bit = CURRENT_LATCHES.STATE_NUMBER * CONTROL_STORE_ROWS + NEXT_LATCHES.STATE_NUMBER;
+
+  if ((FUZZ->STATES[bit >> 3] & (1 << (bit & 7))) == 0) {
+    FUZZ->STATES[bit >> 3] |= 1 << (bit & 7);
+    FUZZ->NEW_STATES++;
+  }
+}
+
+/* Check a retired instruction against the reference model. */
+static void fuzz_retire()
+{
+  Retire_Record exp;
+  int word = COSIM_RECORD.PC >> 1;
+  lc3b_machine *m = FUZZ->MACHINE;
+
+  if ((FUZZ->PCS[word >> 3] & (1 << (word & 7))) == 0) {
+    FUZZ->PCS[word >> 3] |= 1 << (word & 7);
+    FUZZ->NEW_PCS++;
+  }
+
+  ref_execute(&FUZZ->REF, &exp);
+  if (exp.MEM_SIZE)
+    mark_written(exp.MEM_ADDR >> 1);
+
+  if (cosim_compare(&COSIM_RECORD, &exp, FUZZ->REF.INSTRUCTIONS, m->REPORT, sizeof(m->REPORT))) {
+    m->DIVERGED = TRUE;
+    RUN_BIT = FALSE;
+  }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_fuzz_start                                 */
+/*                                                             */
+/* Purpose   : Keep the machine as it is as the base for       */
+/*             fuzzing and clear the coverage.                 */
+/*                                                             */
+/***************************************************************/
+int lc3b_fuzz_start(lc3b_machine *m)
+{
+  Fuzz *z;
+
+  if (!m->FETCH_STATE[m->CONTEXT.LATCHES.STATE_NUMBER] || m->CONTEXT.COUNT != 0) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Fuzzing must start at an instruction boundary");
+    return LC3B_ERROR;
+  }
+  if ((z = m->FUZZ) == NULL && (z = malloc(sizeof(Fuzz))) == NULL) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Can't allocate the fuzzing base");
+    return LC3B_ERROR;
+  }
+
+  /* Memory is put back behind their backs, so neither may be attached. */
+  lc3b_cosim_stop(m);
+  if (HISTORY_MACHINE == m)
+    lc3b_history(m, 0, 0);
+
+  memset(z, 0, sizeof(Fuzz));
+  z->MACHINE = m;
+  z->CONTEXT = m->CONTEXT;
+  z->CONTEXT.RUN_BIT = TRUE;
+  z->BACKEND = m->BACKEND;
+  memcpy(z->MEMORY, m->MEMORY, sizeof(z->MEMORY));
+  memcpy(z->REF.MEMORY, m->MEMORY, sizeof(z->REF.MEMORY));
+  memset(&m->WRITTEN, 0, sizeof(m->WRITTEN));
+  m->FUZZ = z;
+  return LC3B_OK;
+}
+
+void lc3b_fuzz_stop(lc3b_machine *m)
+{
+  free(m->FUZZ);
+  m->FUZZ = NULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_fuzz_run                                   */
+/*                                                             */
+/* Purpose   : Run one input from the fuzzing base.            */
+/*                                                             */
+/***************************************************************/
+int lc3b_fuzz_run(lc3b_machine *m, const unsigned char *input, size_t length,
+                  int max_cycles, lc3b_fuzz_result *result)
+{
+  Fuzz *z = m->FUZZ;
+  Write_Tracker *t = &m->WRITTEN;
+  Core_Context *c;
+  int i, word, address;
+
+  if (z == NULL) {
+    snprintf(m->MESSAGE, sizeof(m->MESSAGE), "Fuzzing has not been started");
+    return LC3B_ERROR;
+  }
+  c = &z->CONTEXT;
+  address = c->LATCHES.PC;
+
+  /* Back to the base: the words written since, then the latches. */
+  for (i = 0; i < t->COUNT; i++) {
+    word = t->LIST[i];
+    m->MEMORY[word][0] = z->REF.MEMORY[word][0] = z->MEMORY[word][0];
+    m->MEMORY[word][1] = z->REF.MEMORY[word][1] = z->MEMORY[word][1];
+    t->MAP[word >> 5] = 0;
+  }
+  t->COUNT = 0;
+  m->CONTEXT = *c;
+  m->BACKEND = z->BACKEND;
+  m->DIVERGED = FALSE;
+  m->REPORT[0] = '\0';
+
+  if (length > (size_t)(2 * WORDS_IN_MEM - address))
+    length = 2 * WORDS_IN_MEM - address;
+  for (i = 0; i < (int)length; i++) {
+    word = (address + i) >> 1;
+    m->MEMORY[word][(address + i) & 1] = z->REF.MEMORY[word][(address + i) & 1] = input[i];
+    track_write(t, word);
+  }
+
+  z->REF.PC = c->LATCHES.PC;
+  z->REF.N = c->LATCHES.N;
+  z->REF.Z = c->LATCHES.Z;
+  z->REF.P = c->LATCHES.P;
+  memcpy(z->REF.REGS, c->LATCHES.REGS, sizeof(z->REF.REGS));
+  z->REF.INSTRUCTIONS = 0;
+  z->NEW_STATES = z->NEW_PCS = 0;
+
+  machine_enter(m);
+  FUZZ = z;
+  COSIM_ACTIVE = COSIM_INLINE;
+  cosim_clear_record();
+  if (LIVE) live_begin();
+  for (i = 0; i < max_cycles && RUN_BIT; i++) {
+    if (CURRENT_LATCHES.PC == 0x0000) {
+      RUN_BIT = FALSE;
+      break;
+    }
+    cycle();
+  }
+  COSIM_ACTIVE = COSIM_OFF;
+  FUZZ = NULL;
+  if (LIVE) live_publish(m->DIVERGED ? LIVE_DIVERGED : LIVE_IDLE);
+  machine_leave(m);
+
+  z->TOTAL_STATES += z->NEW_STATES;
+  z->TOTAL_PCS += z->NEW_PCS;
+  result->status = lc3b_status(m);
+  result->cycles = m->CONTEXT.CYCLE_COUNT - c->CYCLE_COUNT;
+  result->instructions = m->CONTEXT.INSTRUCTION_COUNT - c->INSTRUCTION_COUNT;
+  result->new_states = z->NEW_STATES;
+  result->new_pcs = z->NEW_PCS;
+  return LC3B_OK;
+}
+
+void lc3b_fuzz_coverage(lc3b_machine *m, int *states, int *pcs)
+{
+  *states = m->FUZZ ? m->FUZZ->TOTAL_STATES : 0;
+  *pcs = m->FUZZ ? m->FUZZ->TOTAL_PCS : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Microcode path fusion ////////////////////////////
+
+/* Most microstates don't touch memory, and many of them go to a fixed next
+   state. When the control store is loaded, each row is given the length of
+   the chain that starts there: the states that follow it through J until
+   one accesses memory, one branches (IRD, or COND on READY, BEN or IR[11]),
+   or the microsequencer returns to the fetch state. A branching state still
+   ends its chain, with its next state picked from the latches. A chain runs
+   as one host step: only the gated bus driver is evaluated, the latches are
+   updated in place, and nothing is copied per state.
+
+   A step falls back to cycle() whenever it could not be exact: when fewer
+   cycles are left than the chain is long, when a snapshot or a live update
+   is due inside it, and whenever co-simulation, tracing, activity counting
+   or fuzzing wants to see every cycle. Chains end at the fetch state, so
+   instruction steps stop at the same place too. System mode cores don't
+   fuse. */
+
+static _Thread_local Fusion *FUSION;	/* NULL when fusion is off */
+
+static void fusion_analyze(lc3b_machine *m)
+{
+  int row, state, length, *s;
+
+  for (row = 0; row < CONTROL_STORE_ROWS; row++) {
+    for (state = row, length = 0; length < MAX_CHAIN; state = GetJ(s)) {
+      s = m->CONTROL_STORE[state];
+      if (s[MIO_EN])
+        break;
+      length++;
+      if (s[IRD] || GetCOND(s) != 0 || m->FETCH_STATE[GetJ(s)])
+        break;
+    }
+    m->FUSED.LENGTH[row] = length;
+  }
+}
+
+/* The state after the current one, as eval_micro_sequencer picks it. */
+static inline int fused_next()
+{
+  int j = GetJ(x);
+
+  if (x[IRD])
+    return OPCODE_OF(CURRENT_LATCHES.IR);
+  switch (GetCOND(x)) {
+  case 1:  return (j & ~2) | CURRENT_LATCHES.READY << 1;
+  case 2:  return (j & ~4) | CURRENT_LATCHES.BEN << 2;
+  case 3:  return (j & ~1) | DECODED(CURRENT_LATCHES.IR)->IR_11;
+  default: return j;
+  }
+}
+
+/* One state without memory, with the effect of drive_bus and
+   latch_datapath_values, updating CURRENT_LATCHES in place. */
+static inline void fused_state()
+{
+  int bus = 0, pc, ben, dr;
+
+  if (x[GATE_PC])     bus += CURRENT_LATCHES.PC;
+  if (x[GATE_MDR])    bus += CURRENT_LATCHES.MDR;
+  if (x[GATE_ALU])    bus += GET_ALU_RESULT();
+  if (x[GATE_SHF])    bus += GET_SHF_RESULT();
+  if (x[GATE_MARMUX]) bus += GET_MAR_RESULT();
+  BUS = bus;
+
+  /* Everything that reads the latches goes before the first write. */
+  pc = x[LD_PC] ? GET_PC_RESULT() : CURRENT_LATCHES.PC;
+  ben = x[LD_BEN] ? GETBEN() : CURRENT_LATCHES.BEN;
+  dr = x[DRMUX] ? 7 : DECODED(CURRENT_LATCHES.IR)->DR;
+
+  if (x[LD_MAR]) CURRENT_LATCHES.MAR = bus;
+  CURRENT_LATCHES.PC = pc;
+  if (x[LD_IR])  CURRENT_LATCHES.IR = bus;
+  if (x[LD_CC]) {
+    CURRENT_LATCHES.N = CURRENT_LATCHES.Z = CURRENT_LATCHES.P = 0;
+    if (bus == 0)           CURRENT_LATCHES.Z = 1;
+    else if (bus & 0x8000)  CURRENT_LATCHES.N = 1;
+    else                    CURRENT_LATCHES.P = 1;
+  }
+  CURRENT_LATCHES.BEN = ben;
+  if (x[LD_MDR]) CURRENT_LATCHES.MDR = bus;
+  if (x[LD_REG]) CURRENT_LATCHES.REGS[dr] = bus;
+  CURRENT_LATCHES.READY = 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : fused_step                                      */
+/*                                                             */
+/* Purpose   : Run the chain at the current state if it fits   */
+/*             in budget cycles. Returns the cycles simulated, */
+/*             0 if the caller has to use cycle().             */
+/*                                                             */
+/***************************************************************/
+static int fused_step(int budget)
+{
+  int state = CURRENT_LATCHES.STATE_NUMBER;
+  int length = FUSION->LENGTH[state], k, end;
+
+  if (length == 0 || length > budget || COSIM_ACTIVE || TRACE_FILE || ACTIVITY || FUZZ)
+    return 0;
+  end = CYCLE_COUNT + length;
+  if ((NEXT_SNAPSHOT > CYCLE_COUNT && NEXT_SNAPSHOT < end) ||
+      (LIVE && LIVE->NEXT > CYCLE_COUNT && LIVE->NEXT < end))
+    return 0;
+
+  for (k = 0; k < length; ) {
+    x = CONTROL_STORE[state];
+    state = fused_next();
+    fused_state();
+    k++;
+    if (FETCH_STATE[state])
+      INSTRUCTION_COUNT++;
+    /* The step loops stop at PC 0 between any two cycles. */
+    if (CURRENT_LATCHES.PC == 0x0000)
+      break;
+  }
+
+  CURRENT_LATCHES.STATE_NUMBER = state;
+  memcpy(CURRENT_LATCHES.MICROINSTRUCTION, CONTROL_STORE[state], sizeof(int)*CONTROL_STORE_BITS);
+  NEXT_LATCHES = CURRENT_LATCHES;
+  x = CURRENT_LATCHES.MICROINSTRUCTION;
+  CYCLE_COUNT += k;
+  FUSION->STEPS++;
+  FUSION->CYCLES += k;
+
+  if (CYCLE_COUNT == NEXT_SNAPSHOT) snapshot_take();
+  if (LIVE && CYCLE_COUNT == LIVE->NEXT) live_publish(LIVE_RUNNING);
+  return k;
+}
+
+void lc3b_fusion(lc3b_machine *m, int on)
+{
+  m->FUSING = on;
+}
+
+/* Print the microcode path of one opcode from the fetch state, once for
+   each way its branches can go, with fused chains in brackets. Memory
+   states are marked with a '*' and taken as if READY came at once. */
+static void fusion_path(lc3b_machine *m, FILE *out, int opcode, int *path, int length, char *variant)
+{
+  static const char *names[16] = {
+    "BR", "ADD", "LDB", "STB", "JSR", "AND", "LDW", "STW",
+    "RTI", "XOR", "1010", "1011", "JMP", "SHF", "LEA", "TRAP"
+  };
+  char label[64], text[512];
+  int *s, j, p, k, chain, n = 0, steps = 0, state = path[length - 1];
+
+  if (length > 1 && (m->FETCH_STATE[state] || length == 64)) {
+    if (!m->FETCH_STATE[state])
+      length++;			/* a loop, print it all */
+    for (p = 0; p < length - 1; p += chain, steps++) {
+      chain = m->CONTROL_STORE[path[p]][MIO_EN] ? 1 : m->FUSED.LENGTH[path[p]];
+      if (chain > length - 1 - p)
+        chain = length - 1 - p;
+      if (chain > 1) {
+        n += snprintf(text + n, sizeof(text) - n, "[");
+        for (k = 0; k < chain; k++)
+          n += snprintf(text + n, sizeof(text) - n, k ? " %d" : "%d", path[p + k]);
+        n += snprintf(text + n, sizeof(text) - n, "] ");
+      }
+      else
+        n += snprintf(text + n, sizeof(text) - n,
+                      m->CONTROL_STORE[path[p]][MIO_EN] ? "%d* " : "%d ", path[p]);
+    }
+    fprintf(out, "%-6s %-12s %-7d %-6d %s%s\n", names[opcode], variant, length - 1, steps,
+            text, m->FETCH_STATE[state] ? "" : "...");
+    return;
+  }
+
+  s = m->CONTROL_STORE[state];
+  j = GetJ(s);
+  if (s[IRD]) {
+    path[length] = opcode;
+    fusion_path(m, out, opcode, path, length + 1, variant);
+    return;
+  }
+  switch (GetCOND(s)) {
+  case 0:
+    path[length] = j;
+    fusion_path(m, out, opcode, path, length + 1, variant);
+    break;
+  case 1:
+    path[length] = j | 2;
+    fusion_path(m, out, opcode, path, length + 1, variant);
+    break;
+  default:
+    for (k = 0; k < 2; k++) {
+      snprintf(label, sizeof(label), "%s%s%s=%d", variant, variant[0] ? "," : "",
+               GetCOND(s) == 2 ? "BEN" : "IR11", k);
+      path[length] = GetCOND(s) == 2 ? (j & ~4) | k << 2 : (j & ~1) | k;
+      fusion_path(m, out, opcode, path, length + 1, label);
+    }
+    break;
+  }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3b_fusion_report                              */
+/*                                                             */
+/* Purpose   : Print the fused chains, the path of every       */
+/*             opcode through them and how many cycles ran     */
+/*             fused.                                          */
+/*                                                             */
+/***************************************************************/
+void lc3b_fusion_report(lc3b_machine *m, FILE *out)
+{
+  int path[65], row, k, opcode;
+
+  fprintf(out, "Chains of more than one state:\n");
+  fprintf(out, "State  Length  States\n");
+  for (row = 0; row < CONTROL_STORE_ROWS; row++) {
+    if (m->FUSED.LENGTH[row] < 2)
+      continue;
+    fprintf(out, "%-6d %-7d", row, m->FUSED.LENGTH[row]);
+    for (k = 0, path[0] = row; k < m->FUSED.LENGTH[row]; k++) {
+      fprintf(out, " %d", path[0]);
+      path[0] = GetJ(m->CONTROL_STORE[path[0]]);
+    }
+    fprintf(out, "\n");
+  }
+
+  fprintf(out, "\nPaths from the fetch state ([ ] fused, * memory):\n");
+  fprintf(out, "Opcode Variant      States  Steps  Path\n");
+  for (opcode = 0; opcode < 16; opcode++) {
+    path[0] = INITIAL_STATE_NUMBER;
+    fusion_path(m, out, opcode, path, 1, "");
+  }
+
+  fprintf(out, "\nFusion is %s. %llu fused steps covered %llu cycles",
+          m->FUSING ? "on" : "off", m->FUSED.STEPS, m->FUSED.CYCLES);
+  if (m->FUSED.STEPS)
+    fprintf(out, ", %.2f per step", (double)m->FUSED.CYCLES / m->FUSED.STEPS);
+  fprintf(out, ".\n");
+}
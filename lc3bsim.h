@@ -0,0 +1,300 @@
+/***************************************************************/
+/*                                                             */
+/* LC-3b Simulator library                                     */
+/*                                                             */
+/* The microarchitectural simulator as an in-process API. A    */
+/* machine owns its control store, memory and latches, so a    */
+/* test runner can create one machine and run any number of    */
+/* programs on it without starting a process or parsing text.  */
+/*                                                             */
+/* Calls on the same machine must not overlap. Different       */
+/* machines may be used from different threads at once, except */
+/* for the debugging features that exist once per process.     */
+/*                                                             */
+/***************************************************************/
+
+#ifndef LC3BSIM_H
+#define LC3BSIM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lc3b_machine lc3b_machine;
+
+/***************************************************************/
+/* Return codes.                                               */
+/***************************************************************/
+#define LC3B_OK     0
+#define LC3B_ERROR -1
+
+/***************************************************************/
+/* Machine status, see lc3b_status.                            */
+/***************************************************************/
+enum lc3b_status {
+    LC3B_RUNNING,		/* can be stepped */
+    LC3B_HALTED,		/* reached PC 0x0000 */
+    LC3B_DIVERGED		/* co-simulation found a mismatch */
+};
+
+/***************************************************************/
+/* Registers and latches, see lc3b_get_reg.                    */
+/***************************************************************/
+enum lc3b_reg {
+    LC3B_R0, LC3B_R1, LC3B_R2, LC3B_R3, LC3B_R4, LC3B_R5, LC3B_R6, LC3B_R7,
+    LC3B_PC, LC3B_IR, LC3B_MAR, LC3B_MDR,
+    LC3B_N, LC3B_Z, LC3B_P, LC3B_BEN,
+    LC3B_STATE_NUMBER,		/* read only */
+    LC3B_BUS			/* read only, value in the last cycle */
+};
+
+/***************************************************************/
+/* Creating and loading machines.                              */
+/***************************************************************/
+
+/* A machine with zeroed memory, an empty control store and the latches
+   in their reset state. Returns NULL if out of memory. */
+lc3b_machine *lc3b_create(void);
+void lc3b_destroy(lc3b_machine *m);
+
+/* Load the control store from the text of a ucode file, one row of
+   0/1 characters per line. This may be done at any time: on success the
+   new control store replaces the old one at the current microinstruction
+   boundary, memory and latches are kept, and the current microinstruction
+   is fetched again for the current state. An invalid file leaves the old
+   control store in place. Returns LC3B_OK or LC3B_ERROR; lc3b_message
+   explains errors and warnings. */
+int lc3b_load_ucode(lc3b_machine *m, const char *text, size_t length);
+
+/* Load a program image in the assembler's text format: the byte address
+   to load at, followed by one hex word per line. The first program
+   loaded sets the starting PC. Returns the number of words loaded or
+   LC3B_ERROR. */
+int lc3b_load_program(lc3b_machine *m, const char *text, size_t length);
+
+/* Zero memory and return the latches to their reset state, keeping the
+   control store. */
+void lc3b_reset(lc3b_machine *m);
+
+/* The last error or warning, "" if none. */
+const char *lc3b_message(lc3b_machine *m);
+
+/* Select how memory accesses are timed, "fixed" if spec is NULL:
+     fixed[:cycles]                          every access takes cycles (5)
+     banked[:banks:hit:miss:row_bytes:busy]  interleaved banks with an open
+                                             row each; an access takes hit
+                                             or miss cycles, and the bank is
+                                             busy for busy cycles after it
+                                             (4:3:5:64:2)
+     wbuf[:cycles:depth:post]                stores are posted to a write
+                                             buffer in post cycles and drain
+                                             in the background (5:4:2)
+   Accesses take at least 2 cycles. Fails while an access is in progress.
+   System mode always uses fixed 5-cycle timing on its shared bus. */
+int lc3b_set_memory(lc3b_machine *m, const char *spec);
+
+/* The backend in use, as a complete spec. */
+const char *lc3b_memory(lc3b_machine *m);
+
+/***************************************************************/
+/* Running.                                                    */
+/***************************************************************/
+
+/* Run straight-line microstate chains as single host steps (on = 1, the
+   default) or every cycle through the full datapath (on = 0). Results
+   and cycle counts are the same either way. */
+void lc3b_fusion(lc3b_machine *m, int on);
+
+/* Print the chains found in the control store, the microcode path of
+   each opcode through them, and how many cycles ran fused. */
+void lc3b_fusion_report(lc3b_machine *m, FILE *out);
+
+/* Simulate up to n cycles, stopping early when the machine halts.
+   Returns the number of cycles simulated. */
+int lc3b_step_cycles(lc3b_machine *m, int n);
+
+/* Simulate until n more instructions have completed or the machine
+   halts. Returns the number of instructions completed. */
+int lc3b_step_instructions(lc3b_machine *m, int n);
+
+int lc3b_status(lc3b_machine *m);
+int lc3b_cycles(lc3b_machine *m);
+int lc3b_instructions(lc3b_machine *m);
+
+/***************************************************************/
+/* State access. Addresses are byte addresses.                 */
+/***************************************************************/
+int  lc3b_get_reg(lc3b_machine *m, int reg);
+void lc3b_set_reg(lc3b_machine *m, int reg, int value);
+int  lc3b_read_word(lc3b_machine *m, int address);
+void lc3b_write_word(lc3b_machine *m, int address, int value);
+int  lc3b_read_byte(lc3b_machine *m, int address);
+void lc3b_write_byte(lc3b_machine *m, int address, int value);
+
+/***************************************************************/
+/* Debugging and analysis. The reference model and the         */
+/* reverse-execution history exist once per process, so each   */
+/* can be attached to one machine at a time.                   */
+/***************************************************************/
+
+/* Check every retired instruction against the ISA reference model.
+   Starts at the next instruction boundary. Returns LC3B_OK, or
+   LC3B_ERROR if the model is in use or can't be started. */
+int lc3b_cosim_start(lc3b_machine *m);
+
+/* Check outstanding instructions and detach the model. Returns the
+   number of instructions checked. */
+int lc3b_cosim_stop(lc3b_machine *m);
+
+/* Description of the first divergence, "" if none. Its cycle and PC are
+   those of the diverging instruction; the machine itself is left where
+   the simulator stopped, up to 4096 instructions later. */
+const char *lc3b_cosim_report(lc3b_machine *m);
+
+typedef struct lc3b_core_stats {
+    int cycles;
+    int instructions;
+    int bus_stalls;		/* cycles spent waiting for the shared bus */
+} lc3b_core_stats;
+
+/* Run num_cores copies of the machine, each on its own host thread,
+   sharing its memory until all of them halt. Core i starts with R0 = i.
+   Threads synchronize every quantum cycles. Fills in stats[num_cores].
+   Afterwards the machine's memory holds what the cores left in it, but
+   its latches are unchanged. Stall counts are exact at a quantum of 1;
+   with a longer quantum which core stalls, and for how long, depends on
+   host thread timing. Returns LC3B_OK or LC3B_ERROR. */
+int lc3b_run_system(lc3b_machine *m, int num_cores, int quantum, lc3b_core_stats *stats);
+
+/* Snapshot the latches every interval cycles and log overwritten memory,
+   keeping at most budget_kb kilobytes. An interval of 0 turns this off.
+   Returns LC3B_OK or LC3B_ERROR. */
+int lc3b_history(lc3b_machine *m, int interval, int budget_kb);
+
+/* Put the machine in the state it had at the given cycle, going back
+   through the history or forward by simulating. Cycles simulated again
+   on the way are not counted as activity or traced a second time; cycles
+   stepped again after going back are. Returns LC3B_OK or LC3B_ERROR if
+   the cycle is older than the history kept. */
+int lc3b_goto_cycle(lc3b_machine *m, int cycle);
+
+/* Append binary dump records (see lc3bdump.h) to dump_file: the latches
+   and memory from start to stop, or the words written since the previous
+   incremental dump. Return the number of words dumped or LC3B_ERROR. */
+int lc3b_dump_full(lc3b_machine *m, FILE *dump_file, int start, int stop);
+int lc3b_dump_incremental(lc3b_machine *m, FILE *dump_file);
+
+/***************************************************************/
+/* Timing replay.                                              */
+/***************************************************************/
+
+/* Record the microstates and memory accesses of every following cycle
+   to trace_file, until lc3b_trace_stop. Returns LC3B_OK or LC3B_ERROR. */
+int  lc3b_trace_start(lc3b_machine *m, FILE *trace_file);
+void lc3b_trace_stop(lc3b_machine *m);
+
+typedef struct lc3b_timing {
+    int mem_cycles;		/* cycles per memory access, 5 in the shipped machine */
+    int cache_lines;		/* 0 for no cache */
+    int line_bytes;
+    int hit_cycles;		/* cycles per read that hits */
+} lc3b_timing;
+
+typedef struct lc3b_replay_stats {
+    int cycles;
+    int instructions;
+    int reads, writes;
+    int hits, misses;		/* reads that hit or missed the cache */
+    int write_hits, write_misses;	/* writes to a cached line or not; they
+				   cost mem_cycles either way */
+} lc3b_replay_stats;
+
+/* Re-time a recorded trace against another memory system without
+   simulating the datapath. The cache is direct mapped and write through.
+   With mem_cycles 5 and no cache the cycle count is that of the recorded
+   run. Returns LC3B_OK, or LC3B_ERROR for a bad trace or timing. */
+int lc3b_trace_replay(FILE *trace_file, const lc3b_timing *timing, lc3b_replay_stats *stats);
+
+/***************************************************************/
+/* Switching activity, for energy estimates.                   */
+/***************************************************************/
+enum lc3b_activity_counter {
+    LC3B_ACT_CYCLES,		/* cycles counted */
+    LC3B_ACT_BUS,		/* bit toggles on BUS */
+    LC3B_ACT_PC, LC3B_ACT_IR, LC3B_ACT_MAR, LC3B_ACT_MDR,
+    LC3B_ACT_REGS,		/* bit toggles, all registers together */
+    LC3B_ACT_MEM_READS,		/* accesses */
+    LC3B_ACT_MEM_READ_BITS,	/* toggles on the data read */
+    LC3B_ACT_MEM_WRITES,	/* accesses */
+    LC3B_ACT_MEM_WRITE_BITS,	/* memory bits changed */
+    LC3B_ACT_LD_MAR, LC3B_ACT_LD_MDR, LC3B_ACT_LD_IR, LC3B_ACT_LD_BEN,
+    LC3B_ACT_LD_REG, LC3B_ACT_LD_CC, LC3B_ACT_LD_PC,	/* cycles asserted */
+    LC3B_ACT_GATE_PC, LC3B_ACT_GATE_MDR, LC3B_ACT_GATE_ALU,
+    LC3B_ACT_GATE_MARMUX, LC3B_ACT_GATE_SHF,		/* cycles asserted */
+    LC3B_ACTIVITY_COUNTERS
+};
+
+/* Start counting from zero (on = 1), or stop and keep the counts (on = 0).
+   System mode cores are not counted. */
+void lc3b_activity(lc3b_machine *m, int on);
+void lc3b_activity_counts(lc3b_machine *m, unsigned long long counts[LC3B_ACTIVITY_COUNTERS]);
+
+/* The name of a counter as used in weight files ("BUS", "LD_MAR", ...),
+   or NULL. */
+const char *lc3b_activity_name(int counter);
+
+/***************************************************************/
+/* Live statistics.                                            */
+/***************************************************************/
+
+/* Publish cycles, instructions retired, PC, state, cycles per second and
+   memory accesses to path, a shared page laid out as in lc3blive.h.
+   The page is updated every interval cycles and whenever a step call
+   returns, under a seqlock, so readers never slow the machine down.
+   Memory accesses are counted from the call. System mode cores are not
+   published. Returns LC3B_OK or LC3B_ERROR. */
+int  lc3b_live_start(lc3b_machine *m, const char *path, int interval);
+
+/* Mark the page detached and stop updating it. */
+void lc3b_live_stop(lc3b_machine *m);
+
+/***************************************************************/
+/* Fuzzing.                                                    */
+/***************************************************************/
+
+/* Keep the machine as it is, which must be at an instruction boundary,
+   as the base every fuzzing input runs from, and clear the coverage.
+   Co-simulation and reverse execution are turned off, and the words
+   written since the last incremental dump are forgotten. Returns LC3B_OK
+   or LC3B_ERROR. */
+int  lc3b_fuzz_start(lc3b_machine *m);
+void lc3b_fuzz_stop(lc3b_machine *m);
+
+typedef struct lc3b_fuzz_result {
+    int status;			/* LC3B_HALTED, LC3B_DIVERGED, or LC3B_RUNNING
+				   if the budget ran out */
+    int cycles, instructions;
+    int new_states;		/* microstate transitions first seen */
+    int new_pcs;		/* instruction addresses first retired */
+} lc3b_fuzz_result;
+
+/* Put the machine back in its base state, write input over memory from
+   the base PC and run it for at most max_cycles cycles, checking every
+   retired instruction against the ISA reference model. The machine is
+   left in its final state; lc3b_cosim_report explains a divergence.
+   Returns LC3B_OK or LC3B_ERROR. */
+int lc3b_fuzz_run(lc3b_machine *m, const unsigned char *input, size_t length,
+                  int max_cycles, lc3b_fuzz_result *result);
+
+/* Coverage since lc3b_fuzz_start: microstate transitions and instruction
+   addresses seen. */
+void lc3b_fuzz_coverage(lc3b_machine *m, int *states, int *pcs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+/***************************************************************/
+/*                                                             */
+/* lc3btop - watch running LC-3b simulators                    */
+/*                                                             */
+/* Usage: lc3btop [-i seconds] [-n refreshes] <stats_file> ... */
+/*                                                             */
+/* Each stats file is the page a simulator publishes with the  */
+/* live command. lc3btop maps them read only and prints one    */
+/* line per simulator every interval, with the rates seen      */
+/* since the previous refresh. It never blocks the simulators. */
+/*                                                             */
+/***************************************************************/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lc3blive.h"
+
+/***************************************************************/
+/* One watched simulator.                                      */
+/***************************************************************/
+typedef struct Instance_Struct {
+    char *FILENAME;
+    const volatile Live_Page *PAGE;	/* NULL if the file is not a stats page */
+    Live_Page LAST;			/* copy at the previous refresh */
+    int SEEN;				/* LAST is valid */
+} Instance;
+
+static const char *status_names[] = { "run", "idle", "halted", "diverged", "detached" };
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : open_page                                       */
+/*                                                             */
+/* Purpose   : Map the stats page of a simulator, or return    */
+/*             NULL with a message.                            */
+/*                                                             */
+/***************************************************************/
+const volatile Live_Page *open_page(char *stats_filename) {
+    Live_Page *page;
+    struct stat info;
+    int fd;
+
+    if ((fd = open(stats_filename, O_RDONLY)) < 0) {
+	printf("Error: Can't open stats file %s\n", stats_filename);
+	return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Live_Page)) {
+	printf("Error: %s is not an LC-3b stats file\n", stats_filename);
+	close(fd);
+	return NULL;
+    }
+    page = mmap(NULL, sizeof(Live_Page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+	printf("Error: Can't map stats file %s\n", stats_filename);
+	return NULL;
+    }
+    if (memcmp(page->MAGIC, LIVE_MAGIC, 4) != 0 || page->VERSION != LIVE_VERSION) {
+	printf("Error: %s is not a version %d LC-3b stats file\n", stats_filename, LIVE_VERSION);
+	munmap(page, sizeof(Live_Page));
+	return NULL;
+    }
+    return page;
+}
+
+/* Events per second between two copies of a page. */
+double rate(uint64_t now, uint64_t before, Live_Page *current, Live_Page *last) {
+    if (current->UPDATED_NS <= last->UPDATED_NS || now < before)
+	return 0;
+    return (now - before) * 1e9 / (current->UPDATED_NS - last->UPDATED_NS);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : show                                            */
+/*                                                             */
+/* Purpose   : Print one line for a simulator.                 */
+/*                                                             */
+/***************************************************************/
+void show(Instance *instance) {
+    Live_Page current;
+    const char *status;
+
+    if (instance->PAGE == NULL)
+	return;
+    if (!live_read(instance->PAGE, &current)) {
+	printf("%-20.20s  (update in progress)\n", instance->FILENAME);
+	return;
+    }
+
+    status = current.STATUS <= LIVE_DETACHED ? status_names[current.STATUS] : "?";
+    if (current.STATUS != LIVE_DETACHED && kill(current.PID, 0) != 0 && errno == ESRCH)
+	status = "gone";
+
+    printf("%-20.20s  %-7u %-8s  %-12llu  %-12llu  %-5.3f  %-8.2f",
+	   instance->FILENAME, current.PID, status,
+	   (unsigned long long)current.CYCLES, (unsigned long long)current.INSTRUCTIONS,
+	   current.CYCLES ? (double)current.INSTRUCTIONS / current.CYCLES : 0.0,
+	   current.CYCLES_PER_SECOND / 1e6);
+    if (instance->SEEN)
+	printf("  %-8.2f  %-9.0f  %-9.0f",
+	       rate(current.INSTRUCTIONS, instance->LAST.INSTRUCTIONS, &current, &instance->LAST) / 1e6,
+	       rate(current.MEM_READS, instance->LAST.MEM_READS, &current, &instance->LAST),
+	       rate(current.MEM_WRITES, instance->LAST.MEM_WRITES, &current, &instance->LAST));
+    else
+	printf("  %-8s  %-9s  %-9s", "-", "-", "-");
+    printf("  0x%04x  %u\n", current.PC, current.STATE_NUMBER);
+
+    instance->LAST = current;
+    instance->SEEN = 1;
+}
+
+int main(int argc, char *argv[]) {
+    Instance *instances;
+    double interval = 1;
+    int refreshes = 0, count = 0, i, n = 0;
+
+    while (argc > 2 && argv[1][0] == '-') {
+	if (strcmp(argv[1], "-i") == 0)
+	    interval = atof(argv[2]);
+	else if (strcmp(argv[1], "-n") == 0)
+	    refreshes = atoi(argv[2]);
+	else
+	    break;
+	argv[2] = argv[0];
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc < 2 || argv[1][0] == '-' || interval <= 0) {
+	printf("Error: usage: %s [-i seconds] [-n refreshes] <stats_file> ...\n", argv[0]);
+	exit(1);
+    }
+
+    if ((instances = calloc(argc - 1, sizeof(Instance))) == NULL) {
+	printf("Error: Out of memory\n");
+	exit(-1);
+    }
+    for (i = 1; i < argc; i++) {
+	instances[n].FILENAME = argv[i];
+	if ((instances[n].PAGE = open_page(argv[i])) != NULL)
+	    n++;
+    }
+    if (n == 0)
+	exit(-1);
+
+    while (refreshes == 0 || count < refreshes) {
+	if (isatty(STDOUT_FILENO))
+	    printf("\033[H\033[J");
+	printf("%-20s  %-7s %-8s  %-12s  %-12s  %-5s  %-8s  %-8s  %-9s  %-9s  %-6s  %s\n",
+	       "File", "PID", "Status", "Cycles", "Instructions", "IPC",
+	       "Mcyc/s", "Minst/s", "Reads/s", "Writes/s", "PC", "State");
+	for (i = 0; i < n; i++)
+	    show(&instances[i]);
+	fflush(stdout);
+
+	if (++count == refreshes)
+	    break;
+	usleep((useconds_t)(interval * 1e6));
+	if (!isatty(STDOUT_FILENO))
+	    printf("\n");
+    }
+    return 0;
+}